@@ -0,0 +1,87 @@
+// What the benchmarks share.  Each includes peek.c itself, through this,
+// the way the tests do, so it can time peek's own functions.
+// Run with make bench.  BENCH_ENTRIES sets how big their directories are.
+
+// peek.c is included whole, so its main has to go by another name.
+#define main peek_main
+#include "../peek.c"
+#undef main
+
+#define BENCH_ENTRIES_DEFAULT 200000
+// Each measurement is the best of this many runs.
+#define BENCH_RUNS 5
+
+// Directories made by bench_dir, removed on exit.
+#define BENCH_DIRS_MAX 4
+static char bench_paths[BENCH_DIRS_MAX][PATH_MAX];
+static int  bench_dirs;
+
+__attribute__((unused))
+static double bench_now(void) {
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+__attribute__((unused))
+static int bench_entries(void) {
+    const char * env = getenv("BENCH_ENTRIES");
+    int          n   = env ? atoi(env) : 0;
+
+    return n > 0 ? n : BENCH_ENTRIES_DEFAULT;
+}
+
+static void bench_cleanup(void) {
+    for (int i = 0; i < bench_dirs; ++i) {
+        DIR *           dir = opendir(bench_paths[i]);
+        struct dirent * dent;
+
+        if (dir == NULL) continue;
+        while ((dent = readdir(dir)) != NULL) {
+            if (dent->d_name[0] != '.') unlinkat(dirfd(dir), dent->d_name, 0);
+        }
+        closedir(dir);
+        rmdir(bench_paths[i]);
+    }
+}
+
+// Make a directory in $TMPDIR of count empty files, each named by name,
+// removed again on exit.  Every mode'th is made executable, if mode isn't 0.
+__attribute__((unused))
+static const char * bench_dir(int count, void (*name)(char * buf, int i), int mode) {
+    const char * tmp  = getenv("TMPDIR");
+    char *       path = bench_paths[bench_dirs];
+    char         buf[256];
+    int          fd;
+
+    if (bench_dirs == BENCH_DIRS_MAX) abort();
+    snprintf(path, PATH_MAX, "%s/peek-bench-XXXXXX", tmp && tmp[0] == '/' ? tmp : "/tmp");
+    if (mkdtemp(path) == NULL || (fd = open(path, O_RDONLY | O_DIRECTORY)) < 0) {
+        perror(path);
+        exit(1);
+    }
+    if (bench_dirs++ == 0) atexit(bench_cleanup);
+
+    for (int i = 0; i < count; ++i) {
+        int file;
+
+        name(buf, i);
+        if ((file = openat(fd, buf, O_WRONLY | O_CREAT, mode && i % mode == 0 ? 0755 : 0644)) < 0) {
+            perror(buf);
+            exit(1);
+        }
+        close(file);
+    }
+    close(fd);
+    return path;
+}
+
+// Names like those of a build tree's object files, in no particular order.
+__attribute__((unused))
+static void bench_name(char * buf, int i) {
+    static const char * stems[] = { "main", "parse", "lexer", "util", "node", "table", "io", "test" };
+
+    // Multiplying by an odd number mixes them up without repeating any.
+    snprintf(buf, 256, "%s_%08x.o", stems[i % 8], (unsigned)i * 2654435761u);
+}
@@ -0,0 +1,173 @@
+// Time from a key to the last byte of the frame it draws, with the
+// terminal at the far end of a link.  Before the cursor was tracked, every
+// full redraw asked the terminal where the cursor was, twice, with \e[6n,
+// and waited for each reply.  Here a thread plays the terminal on a pty.
+// It reads what's drawn and answers each \e[6n a round trip later.
+// Page flips are timed as peek draws them now, and again with the two
+// questions the old renew_display asked before drawing.  Moving the
+// selection never asked, so that's only timed as it is.  The \e[6n peek
+// sends itself are counted, and it fails if there are any.
+
+// For posix_openpt and the rest of the pty calls.
+#define _GNU_SOURCE
+#include <stdlib.h>
+
+#include "bench.h"
+
+#define FRAME_ROWS 40
+#define FRAME_COLS 160
+// Each time is the median of this many frames.
+#define FRAMES 11
+
+static int rtts[] = { 0, 10, 50 };
+
+// The terminal's end of the pty, and the program's.
+static int master;
+static int tty;
+
+// The terminal writes a byte here when it has seen the end of a frame.
+static int fenced[2];
+
+static int         rtt_ms;
+static atomic_long queries;
+
+// Read everything drawn, answering \e[6n after rtt_ms, until the pty is
+// closed.  \e[5n, which peek doesn't send, marks the end of a frame.
+static void * terminal(void * arg) {
+    char     buf[65536];
+    uint32_t last = 0;
+    ssize_t  n;
+
+    while ((n = read(master, buf, sizeof(buf))) > 0) {
+        for (ssize_t i = 0; i < n; ++i) {
+            last = last << 8 | (unsigned char)buf[i];
+            if (last == ('\e' << 24 | '[' << 16 | '6' << 8 | 'n')) {
+                struct timespec wait = { rtt_ms / 1000, rtt_ms % 1000 * 1000000L };
+
+                atomic_fetch_add(&queries, 1);
+                nanosleep(&wait, NULL);
+                if (write(master, "\e[1;1R", 6) != 6) return NULL;
+            } else if (last == ('\e' << 24 | '[' << 16 | '5' << 8 | 'n')) {
+                if (write(fenced[1], "", 1) != 1) return NULL;
+            }
+        }
+    }
+    return NULL;
+}
+
+// Wait for the terminal to have read everything written so far.
+static void fence(void) {
+    char c;
+
+    out_str("\e[5n");
+    out_flush();
+    if (read(fenced[0], &c, 1) != 1) exit(1);
+}
+
+// What renew_display did twice before the cursor was tracked: ask where
+// the cursor is and wait for the reply.
+static void ask_cursor(void) {
+    char c;
+
+    out_str("\e[6n");
+    out_flush();
+    while (read(tty, &c, 1) == 1 && c != 'R') {}
+}
+
+static int compare_doubles(const void * a, const void * b) {
+    return *(const double *)a < *(const double *)b ? -1 : *(const double *)a > *(const double *)b;
+}
+
+// Milliseconds to the end of the median frame, flipping the page or
+// moving right, with asks questions about the cursor first when the whole
+// display is drawn.
+static double time_frames(bool flip, int asks) {
+    double times[FRAMES];
+
+    for (int f = 0; f < FRAMES; ++f) {
+        double start = bench_now();
+
+        if (flip) {
+            // Between the first page and the second, so every page has
+            // been typed and laid out before.
+            selected_previously = selected;
+            selected            = i_offset == SELECTED_MIN && i_limit < SELECTED_MAX ? i_limit + 1 : SELECTED_MIN;
+        } else {
+            handle_user_act(USER_ACT_MV_RIGHT);
+        }
+        validate_selection_index();
+        if (display_is_dirty) {
+            for (int q = 0; q < asks; ++q) ask_cursor();
+        }
+        refresh_display();
+        fence();
+        times[f] = (bench_now() - start) * 1e3;
+    }
+    qsort(times, FRAMES, sizeof(*times), compare_doubles);
+    return times[FRAMES / 2];
+}
+
+int main(void) {
+    int            entries = bench_entries();
+    struct winsize size    = { FRAME_ROWS, FRAME_COLS, 0, 0 };
+    struct termios raw;
+    pthread_t      thread;
+    scan_job       job;
+    int            out;
+    const char *   path;
+    listing *      l;
+
+    setlocale(LC_ALL, "");
+    path = bench_dir(entries, bench_name, 0);
+
+    if ((master = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(master) < 0 || unlockpt(master) < 0
+        || (tty = open(ptsname(master), O_RDWR | O_NOCTTY)) < 0 || pipe(fenced) < 0) {
+        perror("pty");
+        return 1;
+    }
+    tcgetattr(tty, &raw);
+    cfmakeraw(&raw);
+    tcsetattr(tty, TCSANOW, &raw);
+    ioctl(tty, TIOCSWINSZ, &size);
+    pthread_create(&thread, NULL, terminal, NULL);
+
+    printf("frame: ms from a key to the end of its frame, %d entries at %dx%d, median of %d\n",
+           entries, FRAME_ROWS, FRAME_COLS, FRAMES);
+    printf("  %6s %14s %14s %10s %10s\n", "rtt ms", "flip, before", "flip, now", "move", "\\e[6n now");
+
+    job        = (scan_job){ AT_FDCWD, (char *)path, &scan_generation, 0, false, false };
+    current_fd = open(path, O_RDONLY | O_DIRECTORY);
+    l          = scan_directory(&job);
+
+    // peek draws to the pty, as it would to a terminal.
+    fflush(stdout);
+    out = dup(STDOUT_FILENO);
+    dup2(tty, STDOUT_FILENO);
+    show_listing(l);
+    refresh_display();
+    fence();
+
+    for (size_t r = 0; r < sizeof(rtts) / sizeof(*rtts); ++r) {
+        double before, now, move;
+        long   sent;
+
+        rtt_ms = rtts[r];
+        before = time_frames(true, 2);
+        atomic_store(&queries, 0);
+        now    = time_frames(true, 0);
+        move   = time_frames(false, 0);
+        sent   = atomic_load(&queries);
+
+        dup2(out, STDOUT_FILENO);
+        printf("  %6d %14.2f %14.2f %10.2f %10ld\n", rtt_ms, before, now, move, sent);
+        fflush(stdout);
+        if (sent != 0) {
+            fprintf(stderr, "frame: peek asked the terminal where the cursor is\n");
+            return 1;
+        }
+        dup2(tty, STDOUT_FILENO);
+    }
+
+    dup2(out, STDOUT_FILENO);
+    return 0;
+}
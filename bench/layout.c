@@ -0,0 +1,299 @@
+// What walking every entry of a big listing costs with what's known about
+// entries kept as it is now, in parallel arrays, and as it was before, in
+// a 32 byte peek_entry apiece.  The old struct is rebuilt here and filled
+// in from the arrays, and each walk does the same work on either.
+// Cache misses are counted with perf_event_open where the kernel has the
+// counters, which VMs often don't.  Otherwise there are only the times.
+// Then layout_columns is timed on the same entries, and on narrow ones that
+// only get too wide for most column counts at the end, against the way it
+// tried each count in turn before.
+
+#include <linux/perf_event.h>
+
+#include "bench.h"
+
+#define LAYOUT_ENTRIES 1000000
+
+// What an entry had before its fields were split into arrays.
+typedef struct peek_entry {
+    int          len;
+    const char * color;
+    char         indicator;
+    bool         typed;
+    bool         measured;
+    int          row;
+    int          col;
+} peek_entry;
+
+static listing *    l;
+static peek_entry * data;
+static long         before_entries; // Passed over by columns_before's tries.
+
+// Entries whose width and kind are filled in, as layout_refine looks for.
+static long measured_before(void) {
+    long n = 0;
+
+    for (int i = 0, count = l->count; i < count; ++i) n += data[i].measured;
+    return n;
+}
+
+static long measured_now(void) {
+    const unsigned char * kinds = listing_kinds(l);
+    long                  n     = 0;
+
+    for (int i = 0, count = l->count; i < count; ++i) n += (kinds[i] & KIND_MEASURED) != 0;
+    return n;
+}
+
+// The layout statistics of every entry, as listing_layout works them out.
+static long layout_before(void) {
+    layout_stats s = { 0 };
+
+    for (int i = 0, count = l->count; i < count; ++i) {
+        if (!data[i].measured) return -1;
+        layout_add(&s, data[i].len + (data[i].indicator ? 1 : 0) + ENTRY_DELIM_LEN);
+    }
+    return s.total_length << 16 | s.widest;
+}
+
+static long layout_now(void) {
+    listing_layout(l, 1);
+    return (long)l->total_length << 16 | l->widest;
+}
+
+// Where every entry was drawn, as redrawing a page looks it up.
+static long cells_before(void) {
+    long n = 0;
+
+    for (int i = 0, count = l->count; i < count; ++i) n += data[i].row + data[i].col;
+    return n;
+}
+
+static long cells_now(void) {
+    const termpos * cells = listing_cells(l);
+    long            n     = 0;
+
+    for (int i = 0, count = l->count; i < count; ++i) n += cells[i].row + cells[i].col;
+    return n;
+}
+
+static struct {
+    const char * name;
+    long (*before)(void);
+    long (*now)(void);
+} walks[] = {
+    { "measured flags", measured_before, measured_now },
+    { "layout",         layout_before,   layout_now },
+    { "cells",          cells_before,    cells_now },
+};
+
+// Before, each count of columns was tried from the most down, each in a
+// pass over the entries that stopped once a line got too long.
+static bool columns_try_before(int count, int most, int * widths) {
+    const uint16_t *      lengths = listing_widths(shown);
+    const unsigned char * kinds   = listing_kinds(shown);
+    int                   line    = count * ENTRY_DELIM_LEN;
+
+    memset(widths, 0, sizeof(*widths) * count);
+    for (int i = 0, j = 0; i < entry_count; ++i) {
+        int length = lengths[i] + (kind_indicator(kinds[i]) ? 1 : 0);
+
+        ++before_entries;
+        if (length > most) length = most;
+        if (length < 1)    length = 1;
+        if (length > widths[j]) {
+            line += length - widths[j];
+            if (line >= termsize.ws_col + ENTRY_DELIM_LEN) return false;
+            widths[j] = length;
+        }
+        if (++j == count) j = 0;
+    }
+    return true;
+}
+
+// The count of columns and the sum of their widths.
+static long columns_before(void) {
+    static int            widths[1024];
+    const uint16_t *      lengths  = listing_widths(shown);
+    const unsigned char * kinds    = listing_kinds(shown);
+    int                   most     = termsize.ws_col - 1;
+    int                   shortest = most;
+    int                   longest  = 0;
+    int                   count;
+    long                  sum      = 0;
+
+    for (int i = 0; i < entry_count; ++i) {
+        int length = lengths[i] + (kind_indicator(kinds[i]) ? 1 : 0);
+
+        if (length > longest)  longest  = length;
+        if (length < shortest) shortest = length;
+    }
+    if (longest > most) longest = most;
+    if (shortest < 1)   shortest = 1;
+    count = (termsize.ws_col - 1 - longest) / (shortest + ENTRY_DELIM_LEN) + 1;
+    if (count > entry_count) count = entry_count;
+    while (count > 1 && !columns_try_before(count, most, widths)) --count;
+    if (count <= 1) {
+        count     = 1;
+        widths[0] = longest;
+    }
+    for (int j = 0; j < count; ++j) sum += widths[j];
+    return (long)count << 32 | sum;
+}
+
+static long columns_now(void) {
+    long sum = 0;
+
+    columns.stale = true;
+    layout_columns();
+    for (int j = 0; j < max_column; ++j) sum += columns.widths[j];
+    return (long)max_column << 32 | sum;
+}
+
+// A counter of cache misses for this thread, or -1 if there isn't one.
+static int miss_counter(void) {
+    struct perf_event_attr attr = { 0 };
+
+    attr.size           = sizeof(attr);
+    attr.type           = PERF_TYPE_HARDWARE;
+    attr.config         = PERF_COUNT_HW_CACHE_MISSES;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv     = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// The best time of walk in milliseconds, and the fewest misses, if counted.
+static double time_walk(long (*walk)(void), int counter, long * misses) {
+    volatile long sink;
+    double        best = 1e9;
+
+    *misses = -1;
+    for (int run = 0; run < BENCH_RUNS; ++run) {
+        long   before = 0;
+        long   after  = 0;
+        double start;
+
+        if (counter >= 0 && read(counter, &before, sizeof(before)) != sizeof(before)) before = -1;
+        start = bench_now();
+        sink  = walk();
+        start = bench_now() - start;
+        if (counter >= 0 && read(counter, &after, sizeof(after)) != sizeof(after)) after = -1;
+
+        if (start < best) best = start;
+        if (counter >= 0 && before >= 0 && after >= 0 && (*misses < 0 || after - before < *misses)) {
+            *misses = after - before;
+        }
+    }
+    (void)sink;
+    return best * 1e3;
+}
+
+// Names of one to three letters, every eighth a directory, then a row of
+// long ones, which make most counts of columns too wide only at the end.
+static void narrow_name(char * buf, int i) {
+    if (i >= LAYOUT_ENTRIES - 64) snprintf(buf, 256, "%s_%02d", "long_name_at_the_end", i % 64);
+    else                          snprintf(buf, 256, "%.*s", 1 + i % 3, "abc");
+}
+
+// A listing of LAYOUT_ENTRIES entries named by name, measured.
+static listing * make_listing(void (*name)(char * buf, int i)) {
+    listing *  made  = listing_new(0);
+    uint32_t * names = malloc(sizeof(uint32_t) * LAYOUT_ENTRIES);
+    char       buf[256];
+
+    if (names == NULL) exit(1);
+    for (int i = 0; i < LAYOUT_ENTRIES; ++i) {
+        name(buf, i);
+        names[i] = push_entry_name(made, buf, i % 8 ? DT_REG : DT_DIR);
+    }
+    made->count = LAYOUT_ENTRIES;
+    made->names = listing_alloc(made, sizeof(uint32_t) * LAYOUT_ENTRIES, _Alignof(uint32_t));
+    listing_alloc_entries(made, LAYOUT_ENTRIES);
+    memcpy(listing_names(made), names, sizeof(uint32_t) * LAYOUT_ENTRIES);
+    memset(listing_kinds(made), 0, LAYOUT_ENTRIES);
+    listing_layout(made, 1);
+    free(names);
+    return made;
+}
+
+int main(void) {
+    const uint16_t *      widths;
+    const unsigned char * kinds;
+    termpos *             cells;
+    listing *             narrow;
+    int                   counter;
+    struct {
+        const char * name;
+        listing **   entries;
+        int          width;
+    } layouts[] = {
+        { "names, 80 wide",   &l,      80 },
+        { "names, 200 wide",  &l,      200 },
+        { "narrow, 80 wide",  &narrow, 80 },
+        { "narrow, 200 wide", &narrow, 200 },
+    };
+
+    setlocale(LC_ALL, "");
+    l      = make_listing(bench_name);
+    narrow = make_listing(narrow_name);
+
+    // Entries laid out in rows of eight, as on a wide terminal.
+    widths = listing_widths(l);
+    kinds  = listing_kinds(l);
+    cells  = listing_cells(l);
+    data   = malloc(sizeof(peek_entry) * LAYOUT_ENTRIES);
+    if (data == NULL) exit(1);
+    for (int i = 0; i < LAYOUT_ENTRIES; ++i) {
+        cells[i] = (termpos){ i / 8, i % 8 * 20 + 1 };
+        data[i]  = (peek_entry){ widths[i], kind_color(kinds[i]), kind_indicator(kinds[i]),
+                                 (kinds[i] & KIND_TYPED) != 0, (kinds[i] & KIND_MEASURED) != 0,
+                                 cells[i].row, cells[i].col };
+    }
+
+    counter = miss_counter();
+    printf("layout: %d entries, %zu bytes apiece before, %zu now, best of %d\n", LAYOUT_ENTRIES,
+           sizeof(peek_entry), sizeof(uint16_t) + 1 + sizeof(termpos), BENCH_RUNS);
+    if (counter < 0) printf("  no cache miss counter: %s\n", strerror(errno));
+    printf("  %-16s %10s %10s %14s %14s\n", "", "before ms", "now ms", "before misses", "now misses");
+
+    for (size_t w = 0; w < sizeof(walks) / sizeof(*walks); ++w) {
+        long   before_misses, now_misses;
+        double before = time_walk(walks[w].before, counter, &before_misses);
+        double now    = time_walk(walks[w].now, counter, &now_misses);
+
+        if (walks[w].before() != walks[w].now()) {
+            fprintf(stderr, "layout: %s differ\n", walks[w].name);
+            return 1;
+        }
+        printf("  %-16s %10.2f %10.2f", walks[w].name, before, now);
+        if (counter < 0) printf(" %14s %14s\n", "-", "-");
+        else             printf(" %14ld %14ld\n", before_misses, now_misses);
+    }
+
+    // Passes are the entries gone over, once for each count of columns
+    // tried, per entry.
+    printf("columns: layout_columns on %d entries, best of %d\n", LAYOUT_ENTRIES, BENCH_RUNS);
+    printf("  %-16s %10s %10s %8s %14s %14s\n", "", "before ms", "now ms", "columns", "before passes",
+           "now passes");
+    entry_count = LAYOUT_ENTRIES;
+    for (size_t c = 0; c < sizeof(layouts) / sizeof(*layouts); ++c) {
+        long   misses, steps;
+        double before, now, passes;
+
+        shown           = *layouts[c].entries;
+        termsize.ws_col = layouts[c].width;
+        before_entries  = 0;
+        before          = time_walk(columns_before, -1, &misses);
+        passes          = (double)before_entries / BENCH_RUNS / LAYOUT_ENTRIES;
+        steps           = stats.column_steps;
+        now             = time_walk(columns_now, -1, &misses);
+        steps           = stats.column_steps - steps;
+        if (columns_before() != columns_now()) {
+            fprintf(stderr, "layout: columns differ for %s\n", layouts[c].name);
+            return 1;
+        }
+        printf("  %-16s %10.2f %10.2f %8d %14.1f %14.1f\n", layouts[c].name, before, now, max_column,
+               passes, (double)steps / BENCH_RUNS / LAYOUT_ENTRIES);
+    }
+    return 0;
+}
@@ -0,0 +1,87 @@
+// Entries read per second by scan_directory against scandir, the way
+// peek read directories before, with and without sorting.
+
+#include "bench.h"
+
+static int scandir_filter(const struct dirent * dent) {
+    return display_filter(dent->d_name);
+}
+
+// Read and filter with scandir, sorting with alphasort if sort.
+static int read_scandir(const char * path, bool sort) {
+    struct dirent ** list;
+    int              n = scandir(path, &list, scandir_filter, sort ? alphasort : NULL);
+
+    for (int i = 0; i < n; ++i) free(list[i]);
+    free(list);
+    return n;
+}
+
+// Read and filter into the arena, as scan_directory does before sorting.
+static int read_getdents(const char * path) {
+    listing * l     = listing_new(0);
+    char *    batch = malloc(SCAN_BATCH_SIZE);
+    int       fd    = open(path, O_RDONLY | O_DIRECTORY);
+    int       count = 0;
+    long      nread;
+
+    while ((nread = syscall(SYS_getdents64, fd, batch, SCAN_BATCH_SIZE)) > 0) {
+        for (char * rec = batch, * end = batch + nread; rec < end;) {
+            scan_entry * ent = (scan_entry *)rec;
+
+            if (display_filter(ent->d_name)) {
+                push_entry_name(l, ent->d_name, ent->d_type);
+                ++count;
+            }
+            rec += ent->d_reclen;
+        }
+    }
+    close(fd);
+    free(batch);
+    listing_free(l);
+    return count;
+}
+
+// The whole scan: read, filter and sort.
+static int read_scan(const char * path) {
+    scan_job  job = { AT_FDCWD, (char *)path, &scan_generation, 0, false, false };
+    listing * l   = scan_directory(&job);
+    int       n   = l->count;
+
+    listing_free(l);
+    return n;
+}
+
+static int scandir_unsorted(const char * path) { return read_scandir(path, false); }
+static int scandir_sorted(const char * path)   { return read_scandir(path, true); }
+
+static void report(const char * what, int (*read)(const char *), const char * path) {
+    double best  = 1e9;
+    int    count = 0;
+
+    for (int run = 0; run < BENCH_RUNS; ++run) {
+        double start = bench_now();
+
+        count = read(path);
+        start = bench_now() - start;
+        if (start < best) best = start;
+    }
+    printf("  %-20s %8.2f ms %6.2fM entries/s\n", what, best * 1e3, count / best / 1e6);
+}
+
+int main(void) {
+    int          count = bench_entries();
+    const char * path;
+
+    setlocale(LC_ALL, "");
+    path = bench_dir(count, bench_name, 0);
+    printf("scan: %d entries, LC_COLLATE=%s, best of %d\n", count, setlocale(LC_COLLATE, NULL), BENCH_RUNS);
+
+    printf(" read and filter\n");
+    report("scandir", scandir_unsorted, path);
+    report("getdents64", read_getdents, path);
+    printf(" and sort\n");
+    report("scandir + alphasort", scandir_sorted, path);
+    report("scan_directory", read_scan, path);
+    return 0;
+}
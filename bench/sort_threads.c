@@ -0,0 +1,129 @@
+// How sorting a big listing scales with the threads in the pool.
+// sort_arena_keys is timed with pools of 1, 2, 4 and 8 threads, and each
+// has to sort the names as the serial sort does.  Where there are fewer
+// CPUs than threads, that only shows what the pool costs, so each is also
+// timed one task at a time, and the longest task of every step is added
+// up.  That's as long as it would take with a CPU for every thread and
+// nothing else slowing them down, so it bounds the speedup the pool could
+// give.  It isn't a measured one.
+// Names are sorted as bytes, as in the C locale.  In other locales
+// sort_entries builds collation keys one at a time before this.
+
+#include "bench.h"
+
+static int max_threads[] = { 1, 2, 4, 8 };
+
+static void pool_start(void * arg, int index) {}
+
+// sort_keys_parallel, one task after another, returning the sum of the
+// longest task of each step.
+static double critical_path(const sort_ctx * ctx, uint32_t * keys, uint32_t * tmp, size_t n, int threads) {
+    parallel_sort ps    = { ctx, keys, tmp, n, 0, (n + threads - 1) / threads, 1 };
+    double        total = 0;
+    double        longest;
+
+    ps.runs = (n + ps.run_len - 1) / ps.run_len;
+
+    longest = 0;
+    for (int i = 0; i < ps.runs; ++i) {
+        double start = bench_now();
+
+        parallel_sort_run(&ps, i);
+        if (bench_now() - start > longest) longest = bench_now() - start;
+    }
+    total += longest;
+
+    while (ps.runs > 1) {
+        int pairs = (ps.runs + 1) / 2;
+
+        ps.segments = threads / pairs > 1 ? threads / pairs : 1;
+        longest = 0;
+        for (int i = 0; i < pairs * ps.segments; ++i) {
+            double start = bench_now();
+
+            parallel_sort_merge(&ps, i);
+            if (bench_now() - start > longest) longest = bench_now() - start;
+        }
+        total += longest;
+
+        uint32_t * swap = ps.src;
+        ps.src      = ps.dst;
+        ps.dst      = swap;
+        ps.runs     = pairs;
+        ps.run_len *= 2;
+    }
+    return total;
+}
+
+int main(void) {
+    int        count = bench_entries();
+    listing *  l     = listing_new(0);
+    sort_ctx   ctx   = { NULL, false, &scan_generation, 0 };
+    uint32_t * shuffled;
+    uint32_t * sorted;
+    uint32_t * tmp;
+    uint32_t   keys_off;
+    char       name[256];
+    double     serial = 0;
+
+    shuffled = malloc(sizeof(uint32_t) * count);
+    sorted   = malloc(sizeof(uint32_t) * count);
+    tmp      = malloc(sizeof(uint32_t) * count);
+    if (shuffled == NULL || sorted == NULL || tmp == NULL) exit(1);
+    for (int i = 0; i < count; ++i) {
+        bench_name(name, i);
+        shuffled[i] = push_entry_name(l, name, DT_REG);
+    }
+    keys_off = listing_alloc(l, sizeof(uint32_t) * count, _Alignof(uint32_t));
+
+    // Start every thread the most threads need, so none is started while timed.
+    pool.size = max_threads[sizeof(max_threads) / sizeof(*max_threads) - 1];
+    pool_run(pool_start, NULL, 1);
+
+    printf("sort: %d names, %ld CPUs online, PARALLEL_SORT_MIN %d, best of %d\n",
+           count, sysconf(_SC_NPROCESSORS_ONLN), PARALLEL_SORT_MIN, BENCH_RUNS);
+    printf("  threads    wall ms  speedup   critical path ms    bound\n");
+
+    for (size_t t = 0; t < sizeof(max_threads) / sizeof(*max_threads); ++t) {
+        int    threads = max_threads[t];
+        double wall    = 1e9;
+        double path    = 1e9;
+
+        // Every thread takes part in a batch whichever it's for, so a
+        // smaller pool is as many tasks.
+        pool.size = threads;
+        for (int run = 0; run < BENCH_RUNS; ++run) {
+            uint32_t * keys = (uint32_t *)(l->mem + keys_off);
+            double     start;
+
+            memcpy(keys, shuffled, sizeof(uint32_t) * count);
+            start = bench_now();
+            sort_arena_keys(l, &ctx, keys_off, count);
+            start = bench_now() - start;
+            if (start < wall) wall = start;
+
+            // Sorting may have grown the listing.  Every pool has to give
+            // the order the serial sort does.
+            keys = (uint32_t *)(l->mem + keys_off);
+            if (threads == 1) {
+                memcpy(sorted, keys, sizeof(uint32_t) * count);
+            } else if (memcmp(sorted, keys, sizeof(uint32_t) * count) != 0) {
+                fprintf(stderr, "sort: %d threads sorted differently\n", threads);
+                return 1;
+            }
+            memcpy(keys, shuffled, sizeof(uint32_t) * count);
+            if (threads == 1) {
+                start = bench_now();
+                sort_keys(&ctx, keys, count, 0);
+                start = bench_now() - start;
+            } else {
+                start = critical_path(&ctx, keys, tmp, count, threads);
+            }
+            if (start < path) path = start;
+        }
+        if (threads == 1) serial = path;
+
+        printf("  %7d %10.2f %7.2fx %18.2f %7.2fx\n", threads, wall * 1e3, serial / wall, path * 1e3, serial / path);
+    }
+    return 0;
+}
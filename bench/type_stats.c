@@ -0,0 +1,120 @@
+// The syscalls made to color entries, which only a stat can do for
+// regular files, since only the mode says whether they're executable.
+// peek's calls to fstatat and syscall are counted here rather than with
+// an LD_PRELOAD shim, which would miss syscall.  Before entries were typed
+// lazily, every regular file cost a faccessat during the scan.
+// The display is 80x24.
+
+#include <stdarg.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int  bench_fstatat(int dirfd, const char * path, struct stat * st, int flags);
+static long bench_syscall(long number, ...);
+
+#define fstatat bench_fstatat
+#define syscall bench_syscall
+#include "bench.h"
+#undef fstatat
+#undef syscall
+
+// Every third file is executable.
+#define BENCH_EXEC_EVERY 3
+
+// The small directory is about as big as a screenful.
+#define BENCH_SMALL 66
+
+static atomic_long fstatat_calls;
+static atomic_long getdents_calls;
+static atomic_long uring_calls;
+
+static int bench_fstatat(int dirfd, const char * path, struct stat * st, int flags) {
+    atomic_fetch_add(&fstatat_calls, 1);
+    return fstatat(dirfd, path, st, flags);
+}
+
+static long bench_syscall(long number, ...) {
+    va_list args;
+    long    a[6];
+
+    va_start(args, number);
+    for (int i = 0; i < 6; ++i) a[i] = va_arg(args, long);
+    va_end(args);
+
+    if (number == SYS_getdents64) atomic_fetch_add(&getdents_calls, 1);
+#if HAVE_IO_URING
+    if (number == SYS_io_uring_enter) atomic_fetch_add(&uring_calls, 1);
+#endif
+    return syscall(number, a[0], a[1], a[2], a[3], a[4], a[5]);
+}
+
+// Scan path and draw the first frame, as pk does, or print it all, as
+// pk -o does, and count the syscalls made.
+static void count(const char * what, const char * path, bool oneshot) {
+    scan_job  job  = { AT_FDCWD, (char *)path, &scan_generation, 0, false, false };
+    int       out  = dup(STDOUT_FILENO);
+    int       null = open("/dev/null", O_WRONLY);
+    listing * l;
+
+    atomic_store(&fstatat_calls, 0);
+    atomic_store(&getdents_calls, 0);
+    atomic_store(&uring_calls, 0);
+
+    cfg_oneshot = oneshot;
+    pen.grid    = !oneshot;
+    current_fd  = open(path, O_RDONLY | O_DIRECTORY);
+    l           = scan_directory(&job);
+
+    // What's drawn goes nowhere.
+    fflush(stdout);
+    dup2(null, STDOUT_FILENO);
+    show_listing(l);
+    termsize = (struct winsize){ 24, 80, 0, 0 };
+    validate_selection_index();
+    renew_display();
+    out_flush();
+    dup2(out, STDOUT_FILENO);
+
+    printf("  %-22s %8d %10ld %10ld %14ld\n", what, l->count, atomic_load(&getdents_calls),
+           atomic_load(&fstatat_calls), atomic_load(&uring_calls));
+
+    show_listing(NULL);
+    close(current_fd);
+    close(null);
+    close(out);
+}
+
+static void small_name(char * buf, int i) {
+    snprintf(buf, 256, "file%02d", i);
+}
+
+int main(void) {
+    int          entries = bench_entries();
+    const char * small;
+    const char * big;
+
+    setlocale(LC_ALL, "");
+    small = bench_dir(BENCH_SMALL, small_name, BENCH_EXEC_EVERY);
+    big   = bench_dir(entries, bench_name, BENCH_EXEC_EVERY);
+
+    printf("type_stats: every %drd file executable\n", BENCH_EXEC_EVERY);
+    printf("  %-22s %8s %10s %10s %14s\n", "", "entries", "getdents64", "fstatat", "io_uring_enter");
+#if HAVE_IO_URING
+    // Each thread sets up its ring on first use.  One that failed falls
+    // back to fstatat, which makes the fstatat lines.
+    meta     = calloc(1, sizeof(*meta));
+    meta->fd = -1;
+#endif
+    count("small", small, false);
+    count("small, -o", small, true);
+    count("big", big, false);
+    count("big, -o", big, true);
+#if HAVE_IO_URING
+    meta = NULL;
+    count("big, io_uring", big, false);
+    count("big, -o, io_uring", big, true);
+#endif
+    return 0;
+}
@@ -0,0 +1,131 @@
+// Time per name of utf8_count's versions, on names in several scripts,
+// against the byte loop utf8_len used before names were measured in
+// terminal columns, which counted every byte that isn't a continuation.
+// The names are packed back to back, as in a listing's arena.
+
+#define PEEK_TEST 1
+#include "bench.h"
+
+#define NAMES  1024
+#define PASSES 10
+// Short runs, and many of them, leave out more of the noise.
+#define RUNS   (BENCH_RUNS * 20)
+
+typedef utf8_counts (*count_fn)(const unsigned char *);
+
+// Before: a column for every printable byte that isn't a continuation.
+static utf8_counts count_bytes(const unsigned char * str) {
+    utf8_counts counts = { 0, 0, 0 };
+    const unsigned char * c = str;
+
+    for (; *c; ++c) counts.columns += UTF8_PRINTABLE(*c) && UTF8_COUNTABLE(*c);
+    counts.size = c - str;
+    return counts;
+}
+
+// Each set's names are pieces picked at random and numbered.
+static const char * set_ascii[]  = { "report", "final", "src", "build_", "test-", "v2", ".txt", ".o" };
+static const char * set_latin[]  = { "résumé", "été", "naïve", "Ångström", "Größe", "señor", "_", "ø" };
+static const char * set_greek[]  = { "Документ", "файл", "Εικόνα", "αρχείο", "_", "Ωμέγα", "Привет", "-" };
+static const char * set_cjk[]    = { "東京", "写真", "資料", "会議", "日本語", "中文", "漢字", "_" };
+static const char * set_kana[]   = { "ひらがな", "カタカナ", "しゃしん", "ファイル", "テスト", "の", "_", "ー" };
+static const char * set_hangul[] = { "한국어", "파일", "사진", "문서", "회의", "자료", "_", "이름" };
+static const char * set_emoji[]  = { "😀", "🎉", "📁", "🚀", "❤️", "✅", "_", "👍🏽" };
+static const char * set_mixed[]  = { "写真", "photo", "ファイル", "한국", "résumé", "😀", "_", "data" };
+
+static struct {
+    const char *  name;
+    const char ** pieces;
+} sets[] = {
+    { "ascii",  set_ascii },
+    { "latin",  set_latin },
+    { "greek",  set_greek },
+    { "cjk",    set_cjk },
+    { "kana",   set_kana },
+    { "hangul", set_hangul },
+    { "emoji",  set_emoji },
+    { "mixed",  set_mixed },
+};
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state >> 32;
+}
+
+// Pack NAMES names from pieces into buf and point names at them.
+static size_t make_names(char * buf, const char ** pieces, const char ** names) {
+    char * p = buf;
+
+    for (int i = 0; i < NAMES; ++i) {
+        int count = 2 + rng() % 4;
+
+        names[i] = p;
+        for (int j = 0; j < count; ++j) p += sprintf(p, "%s", pieces[rng() % 8]);
+        p += sprintf(p, "_%d", i) + 1;
+    }
+    return p - buf;
+}
+
+// Nanoseconds per name of each of fns, the best of many runs.  Each run
+// times every one of them, so they all see the same noise.
+static void time_fns(const count_fn * fns, int n_fns, const char ** names, double * best) {
+    volatile int sink;
+
+    for (int f = 0; f < n_fns; ++f) best[f] = 1e9;
+    for (int run = 0; run < RUNS; ++run) {
+        for (int f = 0; f < n_fns; ++f) {
+            double start = bench_now();
+            int    total = 0;
+
+            for (int pass = 0; pass < PASSES; ++pass) {
+                for (int i = 0; i < NAMES; ++i) total += fns[f]((const unsigned char *)names[i]).columns;
+            }
+            sink  = total;
+            start = bench_now() - start;
+            if (start < best[f]) best[f] = start;
+        }
+    }
+    (void)sink;
+    for (int f = 0; f < n_fns; ++f) best[f] = best[f] / PASSES / NAMES * 1e9;
+}
+
+int main(void) {
+    static char   buf[NAMES * 128];
+    const char *  names[NAMES];
+    count_fn      fns[5]      = { count_bytes, utf8_count_scalar };
+    const char *  fn_names[5] = { "bytes", "decode" };
+    int           n_fns       = 2;
+    double        best[5];
+
+#if HAVE_SSE2
+    fns[n_fns]        = utf8_count_sse2;
+    fn_names[n_fns++] = "sse2";
+    if (__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("popcnt")) {
+        fns[n_fns]        = utf8_count_ssse3;
+        fn_names[n_fns++] = "ssse3";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        fns[n_fns]        = utf8_count_avx2;
+        fn_names[n_fns++] = "avx2";
+    }
+#endif
+
+    printf("utf8_len: ns per name, %d names, best of %d\n", NAMES, RUNS);
+    printf("  %-8s %6s", "", "size");
+    for (int f = 0; f < n_fns; ++f) printf(" %8s", fn_names[f]);
+    printf("\n");
+
+    for (size_t s = 0; s < sizeof(sets) / sizeof(*sets); ++s) {
+        size_t size = make_names(buf, sets[s].pieces, names);
+
+        time_fns(fns, n_fns, names, best);
+        printf("  %-8s %6.1f", sets[s].name, (double)size / NAMES);
+        for (int f = 0; f < n_fns; ++f) printf(" %8.1f", best[f]);
+        printf("\n");
+    }
+    return 0;
+}
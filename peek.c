@@ -18,18 +18,43 @@
 #include <errno.h>
 #include <limits.h>
 #include <locale.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__linux__)
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#if defined(SYS_io_uring_setup) && !defined(NO_IO_URING)
+    #define HAVE_IO_URING 1
+    #include <linux/io_uring.h>
+    #include <linux/stat.h>
+#endif
+#endif
+
+#if defined(__SSE2__) && !defined(NO_SIMD)
+    #define HAVE_SSE2 1
+    #include <immintrin.h>
+#endif
+
+#include "width.h"
+
 #ifndef DEBUG
 #ifndef RELEASE
 #define DEBUG 1
@@ -45,11 +70,16 @@
 #define ANSI_RESET  "\e[m"
 #define ANSI_BOLD   "\e[1m"
 #define ANSI_INVERT "\e[7m"
+#define ANSI_RED    "\e[31m"
 
 #define ANSI_SHOW_CURSOR "\e[?25h"
 #define ANSI_HIDE_CURSOR "\e[?25l"
 
-#define SHORT_FLAGS "aBcFhox"
+// Hold off showing output until the end of a frame, and the end.
+#define ANSI_SYNC_BEGIN "\e[?2026h"
+#define ANSI_SYNC_END   "\e[?2026l"
+
+#define SHORT_FLAGS "aBcCFhoUx"
 #define MSG_USAGE   "Usage: %s [-" SHORT_FLAGS "] [<directory>]"
 #define MSG_INVALID MSG_USAGE "\nTry '%s -h' for more information.\n"
 #define MSG_HELP MSG_USAGE "\nInteractive exploration of directories on the command line.\n"              \
@@ -57,10 +87,15 @@
                            "  -a\tShow files starting with . (hidden by default).\n"                      \
                            "  -B\tDon't output color.\n"                                                  \
                            "  -c\tClear listing on exit.  Ignored with -o.\n"                             \
+                           "  -C\tKeep listings of big directories in $XDG_CACHE_HOME/peek.\n"           \
                            "  -F\tAppend ls style indicators to the end of entries.\n"                    \
                            "  -h\tPrint this message and exit.\n"                                         \
                            "  -o\tPrint listing and exit.  AKA LS mode.\n"                                \
+                           "  -U\tPrint entries unsorted as they are read and exit.  Implies -o.\n"       \
                            "  -x\tPrint unprintable characters as hex.  Carriage return would be \\0D.\n" \
+                           "\nEnvironment:\n"                                                             \
+                           "  PEEK_MEMORY\tMiB for listings, half for those of directories visited before.\n" \
+                           "             \tBigger ones are read from $XDG_CACHE_HOME/peek.  128 by default.\n" \
                            "\nKeys:\n"                                                                    \
                            "   F10|Q \tQuit.\n"                                                           \
                            "   BS|DEL\tOpen parent directory.\n"                                          \
@@ -76,12 +111,107 @@
                            "   X\tExecute selected entry.\n"
 #define MSG_CANT_SCAN "could not scan"
 #define MSG_EMPTY     "empty"
+#define MSG_SCANNING  "scanning..."
 
-// 8.3 was FAT's max filename.  That sounds like a good minimum.
-#define MIN_ENTRY_LEN   11
 #define ENTRY_DELIM     "  "
 #define ENTRY_DELIM_LEN 2
 
+// Bytes requested from each getdents64 call.  Big enough that a directory
+// with hundreds of thousands of entries is read in a few dozen syscalls.
+#define SCAN_BATCH_SIZE (256 * 1024)
+
+// Below this many entries, sorting is done by insertion.
+#define SORT_INSERTION_MAX 12
+
+// Scans taking longer than this show a preview while they run,
+// redrawn at most once per interval.
+#define SCAN_PREVIEW_DELAY_MS    50
+#define SCAN_PREVIEW_INTERVAL_MS 100
+
+// How long to wait on the terminal's replies to sync_query before
+// handing it to a child or back to the shell.
+#define SYNC_REPLY_TIMEOUT_MS 100
+
+// Scans check whether they've been cancelled at least once per this many entries.
+#define SCAN_CANCEL_CHECK 4096
+
+// Listings with more entries than this are laid out from a sample of this
+// many, so they can be shown without measuring every entry first.  The rest
+// are measured as they come into view, and in batches of LAYOUT_REFINE_BATCH
+// while idle, until the layout can be worked out exactly.
+#define LAYOUT_SAMPLE       4096
+#define LAYOUT_REFINE_BATCH 65536
+
+// Times a display is laid out again for entries on it that turned out longer.
+#define LAYOUT_TRIES 3
+
+// The most of the longest entries that column counts are fit to first,
+// once trying counts has gone over as many entries as there are.  See
+// layout_columns.
+#define COLUMN_LONGEST 1024
+
+// Entries that need a stat to be colored are done in batches of this many
+// on the worker pool when a whole listing needs them at once.
+#define TYPE_BATCH 1024
+
+// Where io_uring is available, those stats are statx requests submitted
+// this many at a time, for ranges of at least META_MIN entries.  Fewer,
+// like a page of the display, are done sooner with fstatat.
+#define META_RING_SIZE 256
+#define META_MIN       1024
+
+// Once the selection has rested this long, the directory under it and the
+// parent directory are scanned ahead of time, one at a time.
+#define PREFETCH_DELAY_MS 100
+#define PREFETCH_MAX      2
+
+// Changes to the directory on display are applied once they stop for
+// WATCH_QUIET_MS, or every WATCH_MAX_DELAY_MS while they keep coming.
+// When more names than WATCH_PENDING_MAX change at once, it's rescanned instead.
+#define WATCH_QUIET_MS     50
+#define WATCH_MAX_DELAY_MS 250
+#define WATCH_PENDING_MAX  4096
+
+// Directories with at least this many entries are sorted on every core.
+#ifndef PARALLEL_SORT_MIN
+    #define PARALLEL_SORT_MIN 100000
+#endif
+
+// Scans whose names take more than the memory budget (see MEMORY_BUDGET_MB)
+// are windowed.  The names are sorted in runs of about that size, which go
+// to temporary files and are merged into one, and only a window of that is
+// read back at a time.  Offsets into the merged file are kept for every
+// WINDOW_MARK'th entry, and windows hold at least WINDOW_SIZE entries.
+#define WINDOW_MARK 4096
+#define WINDOW_SIZE 65536
+
+#define ARENA_MIN_SIZE (64 * 1024)
+#define ARENA_MAX_SIZE ((size_t)UINT32_MAX)
+
+// MiB listings may take, unless PEEK_MEMORY says otherwise.  Bigger ones
+// are windowed, and half of it is kept for listings of directories visited
+// before.
+#ifndef MEMORY_BUDGET_MB
+    #define MEMORY_BUDGET_MB 128
+#endif
+// The most PEEK_MEMORY can be.  Listings are addressed with 32 bit offsets.
+#define MEMORY_BUDGET_MAX_MB 4095
+
+// A change made in the same timestamp tick as a scan can't be told apart
+// from the scanned state, so directories changed this recently aren't cached.
+#define LISTING_CACHE_RACY_MS 1000
+
+// With -C, listings of directories with at least this many entries are
+// kept on disk between runs.
+#ifndef DISK_CACHE_MIN
+    #define DISK_CACHE_MIN 10000
+#endif
+
+// Starts every cache file.  Changes whenever their format does.
+#define DISK_CACHE_MAGIC "peekls2"
+// A cache file's arena starts this far in, so it can be mapped in place.
+#define DISK_CACHE_HEADER_SIZE 4096
+
 // UTF8: If 8th bit is set, this code point is multiple bytes.
 // If both the 8th and 7th bits are set, this byte is not the first byte.
 // Therefore, only add to the print count if:
@@ -136,18 +266,86 @@ typedef enum user_action {
     USER_ACT_SHELL,
 } user_action;
 
+// The kernel's dirent64 record, as returned by getdents64.
+typedef struct scan_entry {
+    unsigned long long d_ino;
+    long long          d_off;
+    unsigned short     d_reclen; // Size of the whole record, padding included.
+    unsigned char      d_type;
+    char               d_name[];
+} scan_entry;
+
 typedef struct termpos {
     int row;
     int col;
 } termpos;
 
-typedef struct peek_entry {
-    int len; // Printed UTF8 length, not number of bytes.
-    const char * color;
-    char indicator;
-    int row;
-    int col;
-} peek_entry;
+// What an entry is, as far as its color and indicator go.
+enum entry_kind {
+    KIND_FILE,
+    KIND_FIFO,
+    KIND_CHR,
+    KIND_DIR,
+    KIND_BLK,
+    KIND_LNK,
+    KIND_SOCK,
+    KIND_EXEC,
+};
+
+// An entry's kind is kept in a byte along with these.
+#define KIND_MASK     0x0F
+#define KIND_TYPED    0x40 // The kind is final.  If not, the entry needs a stat.
+#define KIND_MEASURED 0x80 // The kind and width are filled in.
+
+// The result of scanning a directory.
+// Everything in it lives in one arena, released all at once.
+// Names are packed back to back, each preceded by its d_type byte.
+// Entries refer to names by 32 bit offsets into the arena,
+// so it can grow while a scan is running.
+// What's known about each entry is kept in parallel arrays in sorted
+// order, so layout and drawing walk memory in order and touch only the
+// fields they need.
+typedef struct listing {
+    char *   mem;
+    size_t   size;  // Bytes allocated.
+    size_t   used;  // Bytes handed out.
+    char *   map;      // The cache file mem is mapped from, if it is.  See disk_cache_load.
+    size_t   map_size;
+    uint32_t names;    // Offset of the sorted name offsets.
+    uint32_t widths;   // Offset of the entries' printed widths, as uint16_t.
+    uint32_t kinds;    // Offset of their kinds and flags, a byte each.
+    uint32_t cells;    // Offset of where they were last drawn, as termpos.
+    int      count;    // Number of entries, or -1 if the directory couldn't be read.
+    int      capacity; // Room in the per-entry arrays.
+    size_t   garbage;  // Bytes no longer used after updates.
+
+    // Layout statistics.
+    int widest;       // Columns taken by the widest entry, indicator included.
+    int total_length; // See the global of the same name.
+    bool sampled; // The statistics are an estimate from a sample of entries.
+    int  refined; // For those, entries before this have been measured since.
+
+    unsigned generation; // The scan request this answers.
+    bool     partial;    // A preview of a scan still running.
+    bool     sorting;    // For previews, reading is done and sorting has begun.
+    int      scanned;    // For previews, entries read so far.
+
+    // The directory as it was when scanning started, for the cache.
+    dev_t           dev;
+    ino_t           ino;
+    struct timespec mtime;
+    struct timespec ctime;
+    bool            cacheable;  // The directory wasn't changed just before the scan.
+    bool            prefetched; // Scanned ahead of time, for the cache.
+    struct listing * newer;    // Neighbours in the cache.
+    struct listing * older;
+
+    // For windowed listings, the entries are in spill, and only resident
+    // of them from base on are in the arena.  See WINDOW_MARK.
+    struct spill * spill;
+    int            base;
+    int            resident;
+} listing;
 
 enum prompt_t {
     PROMPT_NONE,
@@ -156,21 +354,32 @@ enum prompt_t {
     PROMPT_FOR,
 } prompt = PROMPT_NONE;
 
-static char * current_dir     = NULL;
-static size_t current_dir_len = 0;
+static int    current_fd  = -1;   // The directory on display.
+static char * current_dir = NULL; // Its path, if known.  See dir_path.
 
-static struct dirent ** posix_entries = NULL;
-static peek_entry *     entry_data    = NULL;
-static int              entry_count   = 0; // Number of entries in current dir.
+// Directories navigated out of, innermost last, so going back up
+// doesn't look anything up.  The outermost are closed past the limit.
+#define DIR_STACK_MAX 64
+static int dir_stack[DIR_STACK_MAX];
+static int dir_depth = 0;
+
+static listing *       shown        = NULL;  // Listing on display, if any.
+static uint32_t *      entry_names  = NULL;  // Sorted name offsets.  In shown's arena.
+static unsigned char * entry_kinds  = NULL;  // Its kinds and cells, likewise.
+static termpos *       entry_cells  = NULL;
+static int             entry_base   = 0;     // Index of the entry the arrays start at.
+static int             entry_count  = 0;     // Number of entries in current dir.
+static bool            scan_pending = false; // current_dir's final listing hasn't arrived.
 
 static bool    display_is_dirty = true; // Force display redraw when true.
 static termpos pos_status_bar;          // Column is the start of the selection name.
+                                        // Rows count from the top of the display.
 static int     entry_row_offset = 0;
 
 static bool formatted;     // If true, output will do column formatting.
-static int  avg_columns;   // Average output length of entries.
+static bool piped;         // Oneshot output isn't going to a terminal, so it's a name per line.
 static int  total_length;  // Length of output without newlines.
-static int  max_column;    // Number of format columns printed by last display.
+static int  max_column;    // Number of format columns printed by last display.  See columns.
 static int  newline_count; // Number of lines printed by last display.
 static int  entry_lines;   // Number of lines taken by entries, printed or not.
 
@@ -183,6 +392,9 @@ static int i_limit;
 #define SELECTED_MAX (entry_count - 1)
 static int selected            = SELECTED_MIN;
 static int selected_previously = SELECTED_NOT;
+// Entries to redraw in place at the next refresh, if the display isn't dirty.
+static int redraw_from = SELECTED_NOT;
+static int redraw_to   = SELECTED_NOT;
 // TODO: This size should not be assumed anymore.
 #define SELECTED_MAXLEN 256
 static char selected_name[SELECTED_MAXLEN];
@@ -194,271 +406,4461 @@ static struct termios tcattr_old;
 static struct termios tcattr_raw;
 static struct winsize termsize;
 
-static bool cfg_show_dotfiles = 0; //  (-a) If set, files starting with . will be shown.
-static bool cfg_color         = 1; // !(-B) If set, color output.
-static bool cfg_clear_trace   = 0; //  (-c) If set, clear displayed text on exit.
-static bool cfg_indicate      = 0; //  (-F) If set, append indicators to entries.
-static bool cfg_format_hori   = 0; //  (-H) If set, format horizontally.
-static bool cfg_oneshot       = 0; //  (-o) If set, print listing and exit.  (AKA LS mode.)
-static bool cfg_print_hex     = 0; //  (-x) If set, print unprintable characters as hex.
+static bool cfg_show_dotfiles = 0; //  (-a) If set, files starting with . will be shown.
+static bool cfg_color         = 1; // !(-B) If set, color output.
+static bool cfg_clear_trace   = 0; //  (-c) If set, clear displayed text on exit.
+static bool cfg_disk_cache    = 0; //  (-C) If set, keep listings of big directories on disk.
+static bool cfg_indicate      = 0; //  (-F) If set, append indicators to entries.
+static bool cfg_format_hori   = 0; //  (-H) If set, format horizontally.
+static bool cfg_oneshot       = 0; //  (-o) If set, print listing and exit.  (AKA LS mode.)
+static bool cfg_unsorted      = 0; //  (-U) If set, stream entries in directory order and exit.
+static bool cfg_print_hex     = 0; //  (-x) If set, print unprintable characters as hex.
+
+static size_t cfg_memory_budget = (size_t)MEMORY_BUDGET_MB << 20; // (PEEK_MEMORY) Bytes listings may take.
+
+#if DEBUG
+// Counters for measuring performance in dev builds.
+// Printed to stderr on exit when PEEK_STATS is set in the environment.
+// Those counted off the UI thread, by the scanner or the pool, are atomic.
+static struct {
+    atomic_int    scans;
+    atomic_long   scan_entries;      // Entries read from directories, including filtered ones.
+    atomic_long   scan_syscalls;     // Calls made to read directories.
+    atomic_long   scan_ms;           // Time spent reading, filtering and sorting.
+    atomic_long   arena_names;       // Bytes of names stored, type bytes included.
+    atomic_long   arena_index;       // Bytes of offsets and per-entry data stored.
+    atomic_size_t arena_peak;        // Largest an arena has been.
+    atomic_int    arena_grows;       // Times an arena was reallocated.
+    atomic_long   sort_key_bytes;    // Bytes of collation keys built for sorting.
+    atomic_long   type_stats;        // Entries stat'd because d_type couldn't color them.
+    atomic_long   meta_enters;       // io_uring_enter calls made for them.
+    atomic_int    layout_samples;    // Listings laid out from a sample.
+    int           layout_reflows;    // Of those, redrawn once the layout was exact.
+    int           column_layouts;    // Times the columns were worked out.  See layout_columns.
+    long          column_entries;    // Entries laid out in them.
+    long          column_steps;      // Entries gone over, once for each count of columns tried.
+    double        column_seconds;    // Time spent on them.
+    int           cache_hits;        // Directories shown from the listing cache.
+    int           cache_misses;      // Directories scanned, including stale cache entries.
+    int           cache_stale;       // Cached listings dropped because the directory changed.
+    int           cache_evictions;   // Cached listings dropped to stay within budget.
+    size_t        cache_peak;        // Most memory the cache has held.
+    int           disk_hits;         // Directories shown from a cache file.
+    int           disk_saves;        // Cache files written.
+    atomic_int    windowed;          // Scans too big for memory, spilled to disk.
+    atomic_int    window_runs;       // Sorted runs they were written in.
+    atomic_int    window_loads;      // Windows read back from their merged files.
+    atomic_int    prefetches;        // Directories scanned ahead of time.
+    atomic_int    prefetch_cancels;  // Prefetches dropped before finishing.
+    long          watch_events;      // Events read from inotify.
+    int           watch_updates;     // Batches of changes applied to the display.
+    long          watch_changes;     // Entries inserted, removed or updated by them.
+    int           watch_rescans;     // Batches that were too big and rescanned instead.
+    long          frames;            // Buffers of output written.  See out_flush.
+    long          frame_writes;      // Calls made to write them.
+    long          frame_bytes;       // Bytes in them.
+    long          frame_cells;       // Cells of the display printed in them.  See grid_flush.
+    double        draw_seconds;      // Time spent drawing frames into the grid and diffing them.
+    long          entry_cache_hits;  // Entries drawn by copying their cells.  See entry_draw.
+    long          entry_cache_misses; // Entries drawn from their names.
+} stats;
+
+static void print_stats() {
+    long scan_ms      = atomic_load(&stats.scan_ms);
+    long scan_entries = atomic_load(&stats.scan_entries);
+
+    fprintf(stderr, "scans:          %d\n", atomic_load(&stats.scans));
+    fprintf(stderr, "scan entries:   %ld\n", scan_entries);
+    fprintf(stderr, "scan syscalls:  %ld\n", atomic_load(&stats.scan_syscalls));
+    fprintf(stderr, "scan time:      %ld ms\n", scan_ms);
+    if (scan_ms > 0) {
+        fprintf(stderr, "scan rate:      %.0f entries/s\n", scan_entries * 1e3 / scan_ms);
+    }
+    fprintf(stderr, "arena names:    %ld bytes\n", atomic_load(&stats.arena_names));
+    fprintf(stderr, "arena index:    %ld bytes\n", atomic_load(&stats.arena_index));
+    fprintf(stderr, "arena peak:     %zu bytes\n", atomic_load(&stats.arena_peak));
+    fprintf(stderr, "arena grows:    %d\n", atomic_load(&stats.arena_grows));
+    fprintf(stderr, "cache hits:     %d\n", stats.cache_hits);
+    fprintf(stderr, "cache misses:   %d (%d stale)\n", stats.cache_misses, stats.cache_stale);
+    fprintf(stderr, "cache evicted:  %d\n", stats.cache_evictions);
+    fprintf(stderr, "cache peak:     %zu bytes\n", stats.cache_peak);
+    fprintf(stderr, "disk cache:     %d hits, %d saves\n", stats.disk_hits, stats.disk_saves);
+    fprintf(stderr, "windowed:       %d scans, %d runs, %d loads\n",
+            atomic_load(&stats.windowed), atomic_load(&stats.window_runs), atomic_load(&stats.window_loads));
+    fprintf(stderr, "prefetches:     %d (%d cancelled)\n",
+            atomic_load(&stats.prefetches), atomic_load(&stats.prefetch_cancels));
+    fprintf(stderr, "watch events:   %ld\n", stats.watch_events);
+    fprintf(stderr, "watch updates:  %d (%ld changes, %d rescans)\n",
+            stats.watch_updates, stats.watch_changes, stats.watch_rescans);
+    fprintf(stderr, "sort key bytes: %ld\n", atomic_load(&stats.sort_key_bytes));
+    fprintf(stderr, "type stats:     %ld (%ld io_uring_enter)\n",
+            atomic_load(&stats.type_stats), atomic_load(&stats.meta_enters));
+    fprintf(stderr, "layout samples: %d (%d reflowed)\n", atomic_load(&stats.layout_samples), stats.layout_reflows);
+    fprintf(stderr, "column layouts: %d (%ld entries, each gone over %.1f times, %.3f ms)\n",
+            stats.column_layouts, stats.column_entries,
+            stats.column_entries > 0 ? (double)stats.column_steps / stats.column_entries : 0.0,
+            stats.column_seconds * 1e3);
+    fprintf(stderr, "frames:         %ld (%ld writes, %ld bytes, %ld cells)\n",
+            stats.frames, stats.frame_writes, stats.frame_bytes, stats.frame_cells);
+    if (stats.frames > 0) {
+        fprintf(stderr, "frame average:  %.2f writes, %.0f bytes, %.0f cells\n",
+                (double)stats.frame_writes / stats.frames, (double)stats.frame_bytes / stats.frames,
+                (double)stats.frame_cells / stats.frames);
+    }
+    fprintf(stderr, "draw time:      %.3f ms\n", stats.draw_seconds * 1e3);
+    fprintf(stderr, "entry cache:    %ld hits, %ld misses\n", stats.entry_cache_hits, stats.entry_cache_misses);
+}
+#endif
+
+// Output to the terminal is built up here and written all at once when
+// the frame is done, with one write rather than a stdio flush wherever
+// its buffer happens to fill.  Oneshot and streaming output, which can be
+// any size, goes out whenever OUT_FLUSH_SIZE has built up.
+#define OUT_FLUSH_SIZE (1024 * 1024)
+
+static struct {
+    char * buf;
+    size_t size;
+    size_t used;
+    int    row;   // The cursor's row, counted from the top of the display.
+    int    col;   // Its column, or 0 if that isn't known.
+    int    lines; // Rows the display has reached, which the cursor can move among.
+    unsigned char attr; // What text is printed with.  See out_attr.
+} out;
+
+// Write out everything built up so far.
+static void out_flush() {
+    const char * buf  = out.buf;
+    size_t       left = out.used;
+
+    if (left == 0) return;
+#if DEBUG
+    ++stats.frames;
+    stats.frame_bytes += left;
+#endif
+
+    while (left > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, left);
+#if DEBUG
+        ++stats.frame_writes;
+#endif
+        if (n < 0 && errno == EINTR) continue;
+        // With nowhere for it to go, there's nothing to do but drop it.
+        if (n <= 0) break;
+        buf  += n;
+        left -= n;
+    }
+    out.used = 0;
+}
+
+// Room for size more bytes of output.  Returns where they go.
+static char * out_room(size_t size) {
+    if (out.used + size > out.size) {
+        if (out.used >= OUT_FLUSH_SIZE) out_flush();
+    }
+    if (out.used + size > out.size) {
+        size_t new_size = out.size ? out.size * 2 : 4096;
+        while (new_size < out.used + size) new_size *= 2;
+        if ((out.buf = realloc(out.buf, new_size)) == NULL) exit(1);
+        out.size = new_size;
+    }
+    return out.buf + out.used;
+}
+
+static void out_bytes(const void * bytes, size_t size) {
+    memcpy(out_room(size), bytes, size);
+    out.used += size;
+}
+
+static void out_str(const char * str) {
+    out_bytes(str, strlen(str));
+}
+
+static void out_char(char c) {
+    *out_room(1) = c;
+    ++out.used;
+}
+
+static void out_spaces(int count) {
+    if (count <= 0) return;
+    memset(out_room(count), ' ', count);
+    out.used += count;
+}
+
+static void out_int(int n) {
+    char         digits[12];
+    int          len   = sizeof(digits);
+    unsigned int value = n < 0 ? -(unsigned int)n : (unsigned int)n;
+
+    do {
+        digits[--len] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+    if (n < 0) digits[--len] = '-';
+
+    out_bytes(digits + len, sizeof(digits) - len);
+}
+
+// Move the cursor to row, counted from the top of the display, and col,
+// counted from one.  The display goes wherever the cursor was when it was
+// first drawn, so rows are only ever moved by relative to where the cursor
+// is, and where that is on the screen never has to be asked.
+static void out_goto(int row, int col) {
+    if (row >= out.lines) {
+        // Rows below the display may be below the screen too, where only
+        // newlines go, scrolling it up.  They start lines on the first column.
+        if (out.row < out.lines - 1) out_goto(out.lines - 1, col);
+        for (; out.lines <= row; ++out.lines) out_char('\n');
+        out.row = row;
+        out.col = 1;
+    }
+    if (row != out.row) {
+        int rows = row > out.row ? row - out.row : out.row - row;
+
+        out_str("\e[");
+        if (rows > 1) out_int(rows);
+        out_char(row > out.row ? 'B' : 'A');
+        out.row = row;
+    }
+    if (col != out.col) {
+        if (col == 1) {
+            out_char('\r');
+        } else {
+            out_str("\e[");
+            out_int(col);
+            out_char('G');
+        }
+        out.col = col;
+    }
+}
+
+// A byte that can't be printed, as \XX.
+static void out_hex(unsigned char c) {
+    static const char hex[] = "0123456789ABCDEF";
+    char * p = out_room(3);
+
+    p[0] = '\\';
+    p[1] = hex[c >> 4];
+    p[2] = hex[c & 15];
+    out.used += 3;
+}
+
+// Read a byte of input straight from the terminal.
+// This bypasses stdio so poll sees everything not yet read.
+static int read_byte() {
+    unsigned char c;
+    return read(STDIN_FILENO, &c, 1) == 1 ? c : EOF;
+}
+
+// Whether the terminal shows frames whole.  See sync_query.
+static struct {
+    bool supported;
+    bool pending;   // Replies haven't all come back yet.
+} sync_output;
+
+// Ask the terminal whether it can show frames whole, mode 2026, and for its
+// attributes, which every terminal answers, after.  Nothing waits on them.
+// The replies come in with the keys, where read_reply picks them out.
+static void sync_query() {
+    out_str("\e[?2026$p" "\e[c");
+    sync_output.pending = true;
+}
+
+// Take in a reply to sync_query, after its "\e[?".
+static void read_reply() {
+    int  params[2] = { 0, 0 };
+    int  count     = 0;
+    bool dollar    = false;
+    int  c;
+
+    while ((c = read_byte()) != EOF) {
+        if (c >= '0' && c <= '9') {
+            if (count < 2) params[count] = params[count] * 10 + c - '0';
+        } else if (c == ';') {
+            ++count;
+        } else if (c == '$') {
+            dollar = true;
+        } else {
+            break;
+        }
+    }
+
+    // The mode's state is 1 for set and 2 for reset.  Unknown modes are 0.
+    if (c == 'y' && dollar && params[0] == 2026) sync_output.supported = params[1] == 1 || params[1] == 2;
+    // The attributes come last, so nothing else is on its way.
+    if (c == 'c') sync_output.pending = false;
+}
+
+// Wait a little for the replies to sync_query that haven't come, rather
+// than leave them to whatever reads the terminal next as typed input.
+static void sync_settle() {
+    struct pollfd fd = { STDIN_FILENO, POLLIN, 0 };
+
+    // The query may still be in the buffer if nothing was drawn.
+    if (sync_output.pending) out_flush();
+    while (sync_output.pending && poll(&fd, 1, SYNC_REPLY_TIMEOUT_MS) > 0) {
+        int c = read_byte();
+
+        if (c == EOF) break;
+        if (c == 0x1B && read_byte() == '[' && read_byte() == '?') read_reply();
+    }
+    sync_output.pending = false;
+}
+
+static void restore_tcattr() {
+    out_str(ANSI_SHOW_CURSOR);
+    out_flush();
+    tcsetattr(STDIN_FILENO, TCSANOW, &tcattr_old);
+}
+
+static void restore_tcattr_and_clean() {
+    if (cfg_clear_trace) {
+        // Clear everything beyond the cursor.
+        out_str("\e[0J\e[2K");
+    } else {
+        // Move down a line for every line printed.
+        for (int l = 0; l <= pos_status_bar.row + newline_count; ++l) out_char('\n');
+    }
+    sync_settle();
+
+    restore_tcattr();
+}
+
+// Create raw terminal mode to stop stdin buffer from breaking key press detection.
+// http://pubs.opengroup.org/onlinepubs/000095399/basedefs/termios.h.html#tag_13_74_03_06
+static void replace_tcattr() {
+    static bool first_time = true;
+
+    if (first_time) {
+        atexit(restore_tcattr_and_clean); // Restore old mode when we're done.
+
+        tcgetattr(STDIN_FILENO, &tcattr_old);
+        memcpy(&tcattr_raw, &tcattr_old, sizeof(struct termios));
+        tcattr_raw.c_cc[VMIN]  = 1;
+        tcattr_raw.c_cc[VTIME] = 0;
+        tcattr_raw.c_lflag &= ~(ECHO | ICANON);
+
+        first_time = false;
+    }
+
+    tcsetattr(STDIN_FILENO, TCSANOW, &tcattr_raw);
+    out_str(ANSI_HIDE_CURSOR);
+}
+
+static int display_filter(const char * name) {
+    if (name[0] == '.') {
+        if (!cfg_show_dotfiles) return 0;
+        else if (name[1] == 0) return 0; // Don't show "."
+        else if (name[1] == '.' && name[2] == 0) return 0; // Don't show ".."
+    }
+    return 1;
+}
+
+// Columns a code point takes on a terminal.
+static int code_width(uint32_t code) {
+    const unsigned char * block;
+
+    if (code >= WIDTH_MAX_CODE) return 1;
+    block = width_blocks[width_index[code >> WIDTH_BLOCK_BITS]];
+    code &= (1 << WIDTH_BLOCK_BITS) - 1;
+    return block[code / 4] >> (code % 4 * 2) & 3;
+}
+
+// Decode the code point at str and return the columns it takes, counting
+// an ASCII control as one.  *size is set to its length in bytes.  A byte
+// that doesn't start a valid sequence takes a column by itself and a stray
+// continuation byte takes none, as when only countable bytes were counted.
+static int utf8_width(const unsigned char * str, int * size) {
+    // A sequence cut short, maybe by the NUL, is invalid.
+    *size = 1;
+    if (str[0] < 0x80) return 1;
+    if (str[0] < 0xC0) return 0;
+    if (str[0] < 0xE0) {
+        if (UTF8_COUNTABLE(str[1])) return 1;
+        *size = 2;
+        return code_width((str[0] & 0x1F) << 6 | (str[1] & 0x3F));
+    }
+    if (str[0] < 0xF0) {
+        if (UTF8_COUNTABLE(str[1]) || UTF8_COUNTABLE(str[2])) return 1;
+        *size = 3;
+        return code_width((str[0] & 0x0F) << 12 | (str[1] & 0x3F) << 6 | (str[2] & 0x3F));
+    }
+    if (str[0] < 0xF8) {
+        if (UTF8_COUNTABLE(str[1]) || UTF8_COUNTABLE(str[2]) || UTF8_COUNTABLE(str[3])) return 1;
+        *size = 4;
+        return code_width((uint32_t)(str[0] & 0x07) << 18 | (str[1] & 0x3F) << 12
+                          | (str[2] & 0x3F) << 6 | (str[3] & 0x3F));
+    }
+    return 1;
+}
+
+// What decides how long a string prints.
+typedef struct utf8_counts {
+    int size;     // Bytes before the NUL.
+    int columns;  // Columns taken, counting each control as one.
+    int controls; // Bytes that aren't printable.  These are always ASCII.
+} utf8_counts;
+
+// The reference the vector versions must agree with, which make check
+// tests them against, and what builds without SSE2 use.  Everything is
+// worked out in one decoding pass.
+__attribute__((unused))
+static utf8_counts utf8_count_scalar(const unsigned char * str) {
+    utf8_counts           counts = { 0, 0, 0 };
+    const unsigned char * c      = str;
+    int                   size;
+
+    while (*c) {
+        if (*c < 0x80) {
+            counts.columns  += 1;
+            counts.controls += !UTF8_PRINTABLE(*c);
+            ++c;
+        } else {
+            counts.columns += utf8_width(c, &size);
+            c += size;
+        }
+    }
+    counts.size = c - str;
+    return counts;
+}
+
+#if HAVE_SSE2
+// The vector versions count a column for every byte that isn't a
+// continuation byte, then correct for the lead bytes of multibyte
+// sequences that aren't one column wide.  That gives the same answer as
+// the decoder, since a continuation byte the decoder doesn't skip takes no
+// column either.  Most names are ASCII, where only the NUL and controls
+// need finding.
+// They read 32 bytes at a time, from str itself unless that would cross
+// into another page, then from aligned blocks, which never do.  So they
+// may read past the NUL but never fault.
+// Controls are the bytes unchanged by an unsigned min with 0x1F, or DEL.
+// Lead bytes are the ones above 0xBF as signed bytes, among the high ones.
+// Shuffles on their nibbles sort them into the classes of width.h, and
+// those of one column count right even when invalid.  Whole sequences of
+// leads as wide or as empty as anything they can start are counted all
+// at once, which covers most CJK and all of most alphabets.  Emoji are
+// looked up in width_emoji all at once too, and the rest of CJK and
+// Hangul in width_wide.  Then other three byte sequences in the same
+// block of 256 code points, which are most kana, have their widths looked
+// up together, block by block.  Only what's left after that is decoded one
+// at a time.
+
+// The bits of the leads in a block whose sequences are whole.  conts has
+// the continuation bytes of the block, and above them those of the three
+// bytes after it, if they were read.  three and four are the leads of
+// three and four byte sequences, and bad those of none.
+static inline unsigned utf8_whole(unsigned leads, uint64_t conts, unsigned three, unsigned four, unsigned bad) {
+    return leads & ~bad & conts >> 1 & (conts >> 2 | ~three) & (conts >> 3 | ~four);
+}
+
+// Whether the 35 bytes from block are all in its page, so the bytes after
+// each byte of it can be read straight from memory rather than shifted in.
+static inline bool utf8_ahead(const unsigned char * block) {
+    return ((uintptr_t)block & 4095) <= 4096 - 35;
+}
+
+// Whether there's more than one bit in bits.  One sequence is decoded
+// sooner than its block can be looked up.
+static inline bool utf8_some(unsigned bits) {
+    return bits & (bits - 1);
+}
+
+// The columns beyond one apiece taken by the whole sequences at the leads
+// in bits of block, decoded one at a time.  Each length has its own loop,
+// so a mix of them doesn't upset branch prediction.
+static inline int utf8_whole_widths(const unsigned char * block, unsigned bits, unsigned three, unsigned four) {
+    const unsigned char * c;
+    int                   columns = 0;
+
+    for (unsigned two = bits & ~three; two; two &= two - 1) {
+        c        = block + __builtin_ctz(two);
+        columns += code_width((c[0] & 0x1F) << 6 | (c[1] & 0x3F)) - 1;
+    }
+    for (three &= bits & ~four; three; three &= three - 1) {
+        c        = block + __builtin_ctz(three);
+        columns += code_width((c[0] & 0x0F) << 12 | (c[1] & 0x3F) << 6 | (c[2] & 0x3F)) - 1;
+    }
+    for (four &= bits; four; four &= four - 1) {
+        c        = block + __builtin_ctz(four);
+        columns += code_width((uint32_t)(c[0] & 0x07) << 18 | (c[1] & 0x3F) << 12
+                              | (c[2] & 0x3F) << 6 | (c[3] & 0x3F)) - 1;
+    }
+    return columns;
+}
+
+// The block of widths the last three byte sequences were looked up in.
+// Names in a listing are mostly in one script, so it's tried first, which
+// saves waiting on the loads that find the block of the first lead.
+static _Thread_local int utf8_top;
+
+// The top eight bits of the code point of the three byte sequence at str,
+// which pick its block of widths.
+static inline int utf8_three_top(const unsigned char * str) {
+    return (str[0] & 0x0F) << 4 | (str[1] >> 2 & 0x0F);
+}
+
+// The top bits of the bytes of lo and hi, 32 bytes split in two.
+static inline unsigned utf8_bits(__m128i lo, __m128i hi) {
+    return _mm_movemask_epi8(lo) | (unsigned)_mm_movemask_epi8(hi) << 16;
+}
+
+// The bits set in bits.  Without POPCNT, __builtin_popcount is a call
+// into libgcc, slow enough to show in utf8_count_sse2.
+static inline int utf8_popcount(unsigned bits) {
+    bits -= bits >> 1 & 0x55555555;
+    bits  = (bits & 0x33333333) + (bits >> 2 & 0x33333333);
+    return ((bits + (bits >> 4)) & 0x0F0F0F0F) * 0x01010101 >> 24;
+}
+
+// For CPUs with only SSE2, which can't look widths up in a shuffle.  The
+// NUL, controls and continuation bytes are found 32 bytes at a time as in
+// the others, and then the leads of a block with any are classed and, if
+// need be, decoded one at a time.  So ASCII is as fast as with SSSE3, and
+// other scripts cost about what counting bytes does, or the decoder for
+// those with wide or empty characters.
+static utf8_counts utf8_count_sse2(const unsigned char * str) {
+    const __m128i ctrl  = _mm_set1_epi8(0x1F);
+    const __m128i del   = _mm_set1_epi8(0x7F);
+    const __m128i cont  = _mm_set1_epi8((char)0xBF);
+    const __m128i zero  = _mm_setzero_si128();
+    const unsigned char * block = str;
+    utf8_counts counts = { 0, 0, 0 };
+    int         from   = 0;
+    int         size;
+
+    if (((uintptr_t)str & 4095) > 4096 - 32) {
+        block = (const unsigned char *)((uintptr_t)str & ~(uintptr_t)31);
+        from  = str - block;
+    }
+
+    while (1) {
+        __m128i  lo    = _mm_loadu_si128((const __m128i *)block);
+        __m128i  hi    = _mm_loadu_si128((const __m128i *)block + 1);
+        unsigned nul   = utf8_bits(_mm_cmpeq_epi8(lo, zero), _mm_cmpeq_epi8(hi, zero)) & (0xFFFFFFFFu << from);
+        int      to    = nul ? __builtin_ctz(nul) : 32;
+        unsigned mine  = (0xFFFFFFFFu << from) & (to < 32 ? (1u << to) - 1 : 0xFFFFFFFFu);
+        unsigned ctrls = utf8_bits(_mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(lo, ctrl), lo), _mm_cmpeq_epi8(lo, del)),
+                                   _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(hi, ctrl), hi), _mm_cmpeq_epi8(hi, del))) & mine;
+        unsigned high  = utf8_bits(lo, hi) & mine;
+
+        counts.columns += to - from;
+        if (ctrls) counts.controls += utf8_popcount(ctrls);
+        if (high) {
+            unsigned leads = utf8_bits(_mm_cmpgt_epi8(lo, cont), _mm_cmpgt_epi8(hi, cont)) & high;
+
+            counts.columns -= utf8_popcount(high & ~leads);
+            // Leads in no class of width.h start only sequences of one
+            // column, and those in just one of the others only whole ones
+            // as wide or as empty as its class.  So most alphabets, CJK
+            // and Hangul aren't decoded at all.
+            for (; leads; leads &= leads - 1) {
+                const unsigned char * c     = block + __builtin_ctz(leads);
+                int                   class = width_lead_high[*c >> 4] & width_lead_low[*c & 0x0F];
+
+                if (!class) continue;
+                if (class == WIDTH_LEAD_WIDE && !UTF8_COUNTABLE(c[1]) && !UTF8_COUNTABLE(c[2])) {
+                    counts.columns += 1;
+                } else if (class == WIDTH_LEAD_ZERO && !UTF8_COUNTABLE(c[1])) {
+                    counts.columns -= 1;
+                } else {
+                    counts.columns += utf8_width(c, &size) - 1;
+                }
+            }
+        }
+        if (nul) {
+            counts.size = block + to - str;
+            return counts;
+        }
+        block += 32;
+        from   = (uintptr_t)block & 31;
+        block -= from;
+    }
+}
+
+// a where mask is set, else b.  SSSE3 has no blend.
+static inline __m128i utf8_pick(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Whether bit is set in each byte of v.
+static inline __m128i utf8_has(__m128i v, char bit) {
+    return _mm_cmpeq_epi8(_mm_and_si128(v, _mm_set1_epi8(bit)), _mm_set1_epi8(bit));
+}
+
+// Of 16 bytes v, followed by next and last, the leads of three byte
+// sequences whose code points' top bits are top.  *two and *zero are set
+// to those of them two and no columns wide, by their block of widths.
+// Each byte is looked up in the block's four rows of 64 code points, and
+// the last two bits of the byte after it pick the row.  Those of the byte
+// after that pick the two bits in the byte of the row.
+__attribute__((target("ssse3")))
+static inline __m128i utf8_three_ssse3(__m128i v, __m128i next, __m128i last, int top, const unsigned char * widths,
+                                       __m128i * two, __m128i * zero) {
+    const __m128i bits = _mm_setr_epi8(0x03, 0x0C, 0x30, (char)0xC0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i       at   = _mm_and_si128(_mm_srli_epi16(last, 2), _mm_set1_epi8(0x0F));
+    __m128i       odd  = utf8_has(next, 1);
+    __m128i       w    = utf8_pick(utf8_has(next, 2),
+                                   utf8_pick(odd, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)widths + 3), at),
+                                                  _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)widths + 2), at)),
+                                   utf8_pick(odd, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)widths + 1), at),
+                                                  _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)widths), at)));
+    __m128i       mask = _mm_shuffle_epi8(bits, _mm_and_si128(last, _mm_set1_epi8(3)));
+    __m128i       same = _mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)(0xE0 | top >> 4))),
+                                       _mm_cmpeq_epi8(_mm_and_si128(next, _mm_set1_epi8(0x3C)),
+                                                      _mm_set1_epi8((char)((top & 0x0F) << 2))));
+
+    w     = _mm_and_si128(w, mask);
+    *two  = _mm_and_si128(same, _mm_cmpeq_epi8(w, _mm_and_si128(mask, _mm_set1_epi8((char)0xAA))));
+    *zero = _mm_and_si128(same, _mm_cmpeq_epi8(w, _mm_setzero_si128()));
+    return same;
+}
+
+// Of 16 bytes v, followed by second, third and fourth, the leads of the
+// emoji width_emoji has.  The third byte picks the byte of the bitmap, as
+// the second does the row in utf8_three_ssse3, and the top of the fourth
+// the bit.
+__attribute__((target("ssse3")))
+static inline __m128i utf8_emoji_ssse3(__m128i v, __m128i second, __m128i third, __m128i fourth) {
+    const __m128i bit  = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i       at   = _mm_and_si128(third, _mm_set1_epi8(0x0F));
+    __m128i       odd  = utf8_has(third, 0x10);
+    __m128i       bits = utf8_pick(utf8_has(third, 0x20),
+                                   utf8_pick(odd, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)width_emoji + 3), at),
+                                                  _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)width_emoji + 2), at)),
+                                   utf8_pick(odd, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)width_emoji + 1), at),
+                                                  _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)width_emoji), at)));
+    __m128i       mask = _mm_shuffle_epi8(bit, _mm_and_si128(_mm_srli_epi16(fourth, 3), _mm_set1_epi8(7)));
+
+    return _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)0xF0)),
+                                       _mm_cmpeq_epi8(second, _mm_set1_epi8((char)0x9F))),
+                         _mm_cmpeq_epi8(_mm_and_si128(bits, mask), mask));
+}
+
+// Of 16 bytes v, followed by next, the leads of three byte sequences in
+// the blocks width_wide has, as utf8_emoji_ssse3 looks them up.  The lead
+// and the top bit of the byte after it pick the byte of the bitmap.
+__attribute__((target("ssse3")))
+static inline __m128i utf8_wide_ssse3(__m128i v, __m128i next) {
+    const __m128i bit  = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m128i       at   = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(v, 1), _mm_set1_epi8(0x0E)),
+                                      _mm_and_si128(_mm_srli_epi16(next, 5), _mm_set1_epi8(1)));
+    __m128i       bits = utf8_pick(utf8_has(v, 8), _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)width_wide + 1), at),
+                                                   _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)width_wide), at));
+    __m128i       mask = _mm_shuffle_epi8(bit, _mm_and_si128(_mm_srli_epi16(next, 2), _mm_set1_epi8(7)));
+
+    return _mm_cmpeq_epi8(_mm_and_si128(bits, mask), mask);
+}
+
+// The classes of width.h of the bytes of v.
+__attribute__((target("ssse3")))
+static inline __m128i utf8_class_ssse3(__m128i v) {
+    const __m128i low = _mm_set1_epi8(0x0F);
+
+    return _mm_and_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)width_lead_high),
+                                          _mm_and_si128(_mm_srli_epi16(v, 4), low)),
+                         _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)width_lead_low), _mm_and_si128(v, low)));
+}
+
+// For CPUs with SSSE3 but not AVX2, in two halves of 16 bytes.
+__attribute__((target("ssse3,popcnt")))
+static utf8_counts utf8_count_ssse3(const unsigned char * str) {
+    const __m128i ctrl  = _mm_set1_epi8(0x1F);
+    const __m128i del   = _mm_set1_epi8(0x7F);
+    const __m128i cont  = _mm_set1_epi8((char)0xBF);
+    const __m128i cont_top = _mm_set1_epi8((char)0xC0);
+    const __m128i zero  = _mm_setzero_si128();
+    const unsigned char * block = str;
+    utf8_counts counts = { 0, 0, 0 };
+    int         from   = 0;
+
+    if (((uintptr_t)str & 4095) > 4096 - 32) {
+        block = (const unsigned char *)((uintptr_t)str & ~(uintptr_t)31);
+        from  = str - block;
+    }
+
+    while (1) {
+        __m128i  lo    = _mm_loadu_si128((const __m128i *)block);
+        __m128i  hi    = _mm_loadu_si128((const __m128i *)block + 1);
+        unsigned nul   = utf8_bits(_mm_cmpeq_epi8(lo, zero), _mm_cmpeq_epi8(hi, zero)) & (0xFFFFFFFFu << from);
+        int      to    = nul ? __builtin_ctz(nul) : 32;
+        unsigned mine  = (0xFFFFFFFFu << from) & (to < 32 ? (1u << to) - 1 : 0xFFFFFFFFu);
+        unsigned ctrls = utf8_bits(_mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(lo, ctrl), lo), _mm_cmpeq_epi8(lo, del)),
+                                   _mm_or_si128(_mm_cmpeq_epi8(_mm_min_epu8(hi, ctrl), hi), _mm_cmpeq_epi8(hi, del))) & mine;
+        unsigned high  = utf8_bits(lo, hi) & mine;
+
+        counts.columns += to - from;
+        // Controls and other scripts are rarer, so they can be slower.
+        if (ctrls) counts.controls += __builtin_popcount(ctrls);
+        if (high) {
+            __m128i  class_lo = utf8_class_ssse3(lo);
+            __m128i  class_hi = utf8_class_ssse3(hi);
+            unsigned leads    = utf8_bits(_mm_cmpgt_epi8(lo, cont), _mm_cmpgt_epi8(hi, cont)) & high;
+            unsigned conts    = high & ~leads;
+            unsigned other    = ~utf8_bits(_mm_cmpeq_epi8(class_lo, zero), _mm_cmpeq_epi8(class_hi, zero)) & leads;
+
+            counts.columns -= __builtin_popcount(conts);
+            if (other) {
+                const __m128i wide_class  = _mm_set1_epi8(WIDTH_LEAD_WIDE);
+                const __m128i empty_class = _mm_set1_epi8(WIDTH_LEAD_ZERO);
+                bool     ahead     = utf8_ahead(block);
+                __m128i  second_lo = _mm_alignr_epi8(hi, lo, 1);
+                __m128i  third_lo  = _mm_alignr_epi8(hi, lo, 2);
+                __m128i  fourth_lo = _mm_alignr_epi8(hi, lo, 3);
+                __m128i  second_hi = ahead ? _mm_loadu_si128((const __m128i *)(block + 17)) : _mm_srli_si128(hi, 1);
+                __m128i  third_hi  = ahead ? _mm_loadu_si128((const __m128i *)(block + 18)) : _mm_srli_si128(hi, 2);
+                __m128i  fourth_hi = ahead ? _mm_loadu_si128((const __m128i *)(block + 19)) : _mm_srli_si128(hi, 3);
+                uint64_t follow    = ahead && !nul ? (uint64_t)(_mm_movemask_epi8(_mm_cmplt_epi8(fourth_hi, cont_top)) >> 13) << 32 : 0;
+                unsigned wide  = ~utf8_bits(_mm_cmpeq_epi8(_mm_and_si128(class_lo, wide_class), zero),
+                                            _mm_cmpeq_epi8(_mm_and_si128(class_hi, wide_class), zero));
+                unsigned empty = ~utf8_bits(_mm_cmpeq_epi8(_mm_and_si128(class_lo, empty_class), zero),
+                                            _mm_cmpeq_epi8(_mm_and_si128(class_hi, empty_class), zero));
+                unsigned three = utf8_bits(_mm_cmpgt_epi8(lo, _mm_set1_epi8((char)0xDF)),
+                                           _mm_cmpgt_epi8(hi, _mm_set1_epi8((char)0xDF)));
+                unsigned four  = utf8_bits(_mm_cmpgt_epi8(lo, _mm_set1_epi8((char)0xEF)),
+                                           _mm_cmpgt_epi8(hi, _mm_set1_epi8((char)0xEF)));
+                unsigned whole = utf8_whole(other, conts | follow, three, four,
+                                            utf8_bits(_mm_cmpgt_epi8(lo, _mm_set1_epi8((char)0xF7)),
+                                                      _mm_cmpgt_epi8(hi, _mm_set1_epi8((char)0xF7))));
+                unsigned rest  = whole & ~(wide | empty);
+                int      size;
+
+                counts.columns += __builtin_popcount(wide & whole);
+                counts.columns -= __builtin_popcount(empty & whole);
+                if (rest & four) {
+                    unsigned emoji = 0;
+
+                    // Only the halves with any, as names often end in the first.
+                    if (rest & four & 0xFFFF) emoji  = _mm_movemask_epi8(utf8_emoji_ssse3(lo, second_lo, third_lo, fourth_lo));
+                    if (rest & four >> 16)    emoji |= (unsigned)_mm_movemask_epi8(utf8_emoji_ssse3(hi, second_hi, third_hi, fourth_hi)) << 16;
+                    emoji &= rest;
+
+                    counts.columns += __builtin_popcount(emoji);
+                    rest           &= ~emoji;
+                }
+                // Only when the first is in one of those blocks, so kana,
+                // which never are, don't pay for it, and only for more than
+                // one, like the lookups below.
+                if (utf8_some(rest & three & ~four)) {
+                    int top = utf8_three_top(block + __builtin_ctz(rest & three & ~four));
+
+                    if (width_wide[top >> 3] >> (top & 7) & 1) {
+                        unsigned full = utf8_bits(utf8_wide_ssse3(lo, second_lo), utf8_wide_ssse3(hi, second_hi))
+                                        & rest & three & ~four;
+
+                        counts.columns += __builtin_popcount(full);
+                        rest           &= ~full;
+                    }
+                }
+                for (int top = utf8_top; utf8_some(rest & three & ~four);) {
+                    const unsigned char * widths = width_blocks[width_index[top]];
+                    unsigned              want   = rest & three & ~four;
+                    unsigned              same   = 0;
+                    unsigned              two    = 0;
+                    unsigned              none   = 0;
+                    __m128i               two_v, zero_v;
+
+                    if (want & 0xFFFF) {
+                        same = _mm_movemask_epi8(utf8_three_ssse3(lo, second_lo, third_lo, top, widths, &two_v, &zero_v));
+                        two  = _mm_movemask_epi8(two_v);
+                        none = _mm_movemask_epi8(zero_v);
+                    }
+                    if (want >> 16) {
+                        same |= (unsigned)_mm_movemask_epi8(utf8_three_ssse3(hi, second_hi, third_hi, top, widths, &two_v, &zero_v)) << 16;
+                        two  |= (unsigned)_mm_movemask_epi8(two_v) << 16;
+                        none |= (unsigned)_mm_movemask_epi8(zero_v) << 16;
+                    }
+                    same           &= want;
+                    counts.columns += __builtin_popcount(two & same);
+                    counts.columns -= __builtin_popcount(none & same);
+                    rest           &= ~same;
+                    if (same) utf8_top = top;
+                    // Then the block of the first left, if the last one wasn't it.
+                    if (rest & three & ~four) top = utf8_three_top(block + __builtin_ctz(rest & three & ~four));
+                }
+                if (rest) counts.columns += utf8_whole_widths(block, rest, three, four);
+                for (other &= ~whole; other; other &= other - 1) {
+                    counts.columns += utf8_width(block + __builtin_ctz(other), &size) - 1;
+                }
+            }
+        }
+        if (nul) {
+            counts.size = block + to - str;
+            return counts;
+        }
+        block += 32;
+        from   = (uintptr_t)block & 31;
+        block -= from;
+    }
+}
+
+// utf8_three_ssse3 for 32 bytes.  Blends pick by the top bit of each byte.
+__attribute__((target("avx2")))
+static inline __m256i utf8_three_avx2(__m256i v, __m256i next, __m256i last, int top, const unsigned char * widths,
+                                      __m256i * two, __m256i * zero) {
+    const __m256i bits = _mm256_setr_epi8(0x03, 0x0C, 0x30, (char)0xC0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                          0x03, 0x0C, 0x30, (char)0xC0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m256i       at   = _mm256_and_si256(_mm256_srli_epi16(last, 2), _mm256_set1_epi8(0x0F));
+    __m256i       odd  = _mm256_slli_epi16(next, 7);
+    __m256i       w    = _mm256_blendv_epi8(
+        _mm256_blendv_epi8(_mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)widths)), at),
+                           _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)widths + 1)), at), odd),
+        _mm256_blendv_epi8(_mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)widths + 2)), at),
+                           _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)widths + 3)), at), odd),
+        _mm256_slli_epi16(next, 6));
+    __m256i       mask = _mm256_shuffle_epi8(bits, _mm256_and_si256(last, _mm256_set1_epi8(3)));
+    __m256i       same = _mm256_and_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)(0xE0 | top >> 4))),
+                                          _mm256_cmpeq_epi8(_mm256_and_si256(next, _mm256_set1_epi8(0x3C)),
+                                                            _mm256_set1_epi8((char)((top & 0x0F) << 2))));
+
+    w     = _mm256_and_si256(w, mask);
+    *two  = _mm256_and_si256(same, _mm256_cmpeq_epi8(w, _mm256_and_si256(mask, _mm256_set1_epi8((char)0xAA))));
+    *zero = _mm256_and_si256(same, _mm256_cmpeq_epi8(w, _mm256_setzero_si256()));
+    return same;
+}
+
+// utf8_emoji_ssse3 for 32 bytes.
+__attribute__((target("avx2")))
+static inline __m256i utf8_emoji_avx2(__m256i v, __m256i second, __m256i third, __m256i fourth) {
+    const __m256i bit  = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+                                          1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m256i       at   = _mm256_and_si256(third, _mm256_set1_epi8(0x0F));
+    __m256i       odd  = _mm256_slli_epi16(third, 3);
+    __m256i       bits = _mm256_blendv_epi8(
+        _mm256_blendv_epi8(_mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)width_emoji)), at),
+                           _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)width_emoji + 1)), at), odd),
+        _mm256_blendv_epi8(_mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)width_emoji + 2)), at),
+                           _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)width_emoji + 3)), at), odd),
+        _mm256_slli_epi16(third, 2));
+    __m256i       mask = _mm256_shuffle_epi8(bit, _mm256_and_si256(_mm256_srli_epi16(fourth, 3), _mm256_set1_epi8(7)));
+
+    return _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8((char)0xF0)),
+                                             _mm256_cmpeq_epi8(second, _mm256_set1_epi8((char)0x9F))),
+                            _mm256_cmpeq_epi8(_mm256_and_si256(bits, mask), mask));
+}
+
+// utf8_wide_ssse3 for 32 bytes.
+__attribute__((target("avx2")))
+static inline __m256i utf8_wide_avx2(__m256i v, __m256i next) {
+    const __m256i bit  = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0,
+                                          1, 2, 4, 8, 16, 32, 64, -128, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m256i       at   = _mm256_or_si256(_mm256_and_si256(_mm256_slli_epi16(v, 1), _mm256_set1_epi8(0x0E)),
+                                         _mm256_and_si256(_mm256_srli_epi16(next, 5), _mm256_set1_epi8(1)));
+    __m256i       bits = _mm256_blendv_epi8(
+        _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)width_wide)), at),
+        _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)width_wide + 1)), at),
+        _mm256_slli_epi16(v, 4));
+    __m256i       mask = _mm256_shuffle_epi8(bit, _mm256_and_si256(_mm256_srli_epi16(next, 2), _mm256_set1_epi8(7)));
+
+    return _mm256_cmpeq_epi8(_mm256_and_si256(bits, mask), mask);
+}
+
+// The same for CPUs that have AVX2, 32 bytes to a register.  The bytes
+// after each are shifted down across its lanes.
+__attribute__((target("avx2,popcnt")))
+static utf8_counts utf8_count_avx2(const unsigned char * str) {
+    const __m256i ctrl  = _mm256_set1_epi8(0x1F);
+    const __m256i del   = _mm256_set1_epi8(0x7F);
+    const __m256i cont  = _mm256_set1_epi8((char)0xBF);
+    const __m256i zero  = _mm256_setzero_si256();
+    const __m256i low   = _mm256_set1_epi8(0x0F);
+    const __m256i lead_high = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)width_lead_high));
+    const __m256i lead_low  = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)width_lead_low));
+    const unsigned char * block = str;
+    utf8_counts counts = { 0, 0, 0 };
+    int         from   = 0;
+
+    if (((uintptr_t)str & 4095) > 4096 - 32) {
+        block = (const unsigned char *)((uintptr_t)str & ~(uintptr_t)31);
+        from  = str - block;
+    }
+
+    while (1) {
+        __m256i  v     = _mm256_loadu_si256((const __m256i *)block);
+        unsigned nul   = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, zero)) & (0xFFFFFFFFu << from);
+        int      to    = nul ? __builtin_ctz(nul) : 32;
+        unsigned mine  = (0xFFFFFFFFu << from) & (to < 32 ? (1u << to) - 1 : 0xFFFFFFFFu);
+        unsigned ctrls = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(_mm256_min_epu8(v, ctrl), v),
+                                                              _mm256_cmpeq_epi8(v, del))) & mine;
+        unsigned high  = _mm256_movemask_epi8(v) & mine;
+
+        counts.columns += to - from;
+        if (ctrls) counts.controls += __builtin_popcount(ctrls);
+        if (high) {
+            __m256i  class = _mm256_and_si256(
+                _mm256_shuffle_epi8(lead_high, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)),
+                _mm256_shuffle_epi8(lead_low, _mm256_and_si256(v, low)));
+            unsigned leads = _mm256_movemask_epi8(_mm256_cmpgt_epi8(v, cont)) & high;
+            unsigned conts = high & ~leads;
+            unsigned other = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(class, zero)) & leads;
+
+            counts.columns -= __builtin_popcount(conts);
+            if (other) {
+                bool     ahead  = utf8_ahead(block);
+                __m256i  up     = _mm256_permute2x128_si256(v, v, 0x81);
+                __m256i  second = ahead ? _mm256_loadu_si256((const __m256i *)(block + 1)) : _mm256_alignr_epi8(up, v, 1);
+                __m256i  third  = ahead ? _mm256_loadu_si256((const __m256i *)(block + 2)) : _mm256_alignr_epi8(up, v, 2);
+                __m256i  fourth = ahead ? _mm256_loadu_si256((const __m256i *)(block + 3)) : _mm256_alignr_epi8(up, v, 3);
+                uint64_t follow = ahead && !nul ? (uint64_t)((unsigned)_mm256_movemask_epi8(_mm256_cmpgt_epi8(_mm256_set1_epi8((char)0xC0), fourth)) >> 29) << 32 : 0;
+                unsigned wide   = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(class, _mm256_set1_epi8(WIDTH_LEAD_WIDE)), zero));
+                unsigned empty  = ~_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_and_si256(class, _mm256_set1_epi8(WIDTH_LEAD_ZERO)), zero));
+                unsigned three  = _mm256_movemask_epi8(_mm256_cmpgt_epi8(v, _mm256_set1_epi8((char)0xDF)));
+                unsigned four   = _mm256_movemask_epi8(_mm256_cmpgt_epi8(v, _mm256_set1_epi8((char)0xEF)));
+                unsigned whole  = utf8_whole(other, conts | follow, three, four,
+                                             _mm256_movemask_epi8(_mm256_cmpgt_epi8(v, _mm256_set1_epi8((char)0xF7))));
+                unsigned rest   = whole & ~(wide | empty);
+                int      size;
+
+                counts.columns += __builtin_popcount(wide & whole);
+                counts.columns -= __builtin_popcount(empty & whole);
+                if (rest & four) {
+                    unsigned emoji = _mm256_movemask_epi8(utf8_emoji_avx2(v, second, third, fourth))
+                                     & rest & four;
+
+                    counts.columns += __builtin_popcount(emoji);
+                    rest           &= ~emoji;
+                }
+                // Only when the first is in one of those blocks, so kana,
+                // which never are, don't pay for it, and only for more than
+                // one, like the lookups below.
+                if (utf8_some(rest & three & ~four)) {
+                    int top = utf8_three_top(block + __builtin_ctz(rest & three & ~four));
+
+                    if (width_wide[top >> 3] >> (top & 7) & 1) {
+                        unsigned full = _mm256_movemask_epi8(utf8_wide_avx2(v, second)) & rest & three & ~four;
+
+                        counts.columns += __builtin_popcount(full);
+                        rest           &= ~full;
+                    }
+                }
+                for (int top = utf8_top; utf8_some(rest & three & ~four);) {
+                    const unsigned char * widths = width_blocks[width_index[top]];
+                    __m256i               two_v, zero_v;
+                    unsigned              same;
+
+                    same = _mm256_movemask_epi8(utf8_three_avx2(v, second, third, top, widths, &two_v, &zero_v))
+                           & rest & three & ~four;
+                    counts.columns += __builtin_popcount(_mm256_movemask_epi8(two_v) & same);
+                    counts.columns -= __builtin_popcount(_mm256_movemask_epi8(zero_v) & same);
+                    rest           &= ~same;
+                    if (same) utf8_top = top;
+                    if (rest & three & ~four) top = utf8_three_top(block + __builtin_ctz(rest & three & ~four));
+                }
+                if (rest) counts.columns += utf8_whole_widths(block, rest, three, four);
+                for (other &= ~whole; other; other &= other - 1) {
+                    counts.columns += utf8_width(block + __builtin_ctz(other), &size) - 1;
+                }
+            }
+        }
+        if (nul) {
+            counts.size = block + to - str;
+            return counts;
+        }
+        block += 32;
+        from   = (uintptr_t)block & 31;
+        block -= from;
+    }
+}
+#endif
+
+static utf8_counts utf8_count(const char * str) {
+    const unsigned char * s = (const unsigned char *)str;
+
+#if HAVE_SSE2
+    if (__builtin_cpu_supports("avx2")) return utf8_count_avx2(s);
+    if (__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("popcnt")) return utf8_count_ssse3(s);
+    return utf8_count_sse2(s);
+#else
+    return utf8_count_scalar(s);
+#endif
+}
+
+// Printed length of counts.  Controls print as nothing, or as \XX.
+static int utf8_counts_len(utf8_counts counts) {
+    return counts.columns + counts.controls * (cfg_print_hex ? 2 : -1);
+}
+
+static int utf8_len(unsigned char * str) {
+    return utf8_counts_len(utf8_count((char *)str));
+}
+
+// getcwd, but without an existing buffer.
+// The buffer will resize until it can fit
+// the current working directory, even if
+// it is larger than PATH_MAX.
+static char * sturdy_getcwd() {
+    size_t size  = PATH_MAX;
+    char * path  = NULL;
+    char * valid = NULL;
+
+    for (; !valid; size += PATH_MAX) {
+        path  = realloc(path, size);
+        valid = getcwd(path, size);
+
+        if (!valid && errno != ERANGE) {
+            return NULL;
+        }
+    }
+
+    return path;
+}
+
+#if defined(__linux__)
+// A path naming whatever fd refers to, for interfaces that only take paths.
+static const char * fd_link(int fd) {
+    static char link[32];
+    sprintf(link, "/proc/self/fd/%d", fd);
+    return link;
+}
+#endif
+
+// The path of the directory fd refers to, or NULL if it can't be found.
+// Linux names it under /proc.  Otherwise, briefly change into it and ask.
+static char * fd_path(int fd) {
+    char * path = NULL;
+    int    back;
+
+#if defined(__linux__)
+    for (size_t size = PATH_MAX;; size *= 2) {
+        ssize_t len;
+
+        if ((path = realloc(path, size)) == NULL) exit(1);
+        if ((len = readlink(fd_link(fd), path, size)) < 0) break;
+        if ((size_t)len < size) {
+            path[len] = 0;
+            return path;
+        }
+    }
+    free(path);
+    path = NULL;
+#endif
+
+    if ((back = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) return NULL;
+    if (fchdir(fd) == 0) {
+        path = sturdy_getcwd();
+        if (fchdir(back) < 0) exit(1);
+    }
+    close(back);
+    return path;
+}
+
+// The path of the directory on display.  It's only looked up when it
+// can't be followed from the last one, and not until it's needed.
+static const char * dir_path() {
+    if (current_dir == NULL && (current_dir = fd_path(current_fd)) == NULL) return ".";
+    return current_dir;
+}
+
+// Work out an entry's kind from its d_type,
+// or from its mode if it has been stat'd (0 if not).
+// Returns false if d_type alone can't tell and the mode is needed,
+// which is the case for regular files since only the mode says if
+// they're executable.
+static bool get_entry_type(unsigned char type, mode_t mode, unsigned char * kind) {
+    static const unsigned char kinds[] = {
+        KIND_FILE, // DT_UNKNOWN
+        KIND_FIFO, // DT_FIFO
+        KIND_CHR,  // DT_CHR
+        KIND_FILE,
+        KIND_DIR,  // DT_DIR
+        KIND_FILE,
+        KIND_BLK,  // DT_BLK
+        KIND_FILE,
+        KIND_FILE, // DT_REG
+        KIND_FILE,
+        KIND_LNK,  // DT_LNK
+        KIND_FILE,
+        KIND_SOCK, // DT_SOCK
+    };
+
+    if (mode) type = IFTODT(mode);
+
+    if (type <= DT_SOCK && kinds[type] != KIND_FILE) {
+        *kind = kinds[type];
+        return true;
+    }
+
+    // Like ls, any execute bit makes a regular file executable.
+    if (S_ISREG(mode) && (mode & (S_IXUSR | S_IXGRP | S_IXOTH))) *kind = KIND_EXEC;
+    else                                                          *kind = KIND_FILE;
+    return mode || (type != DT_REG && type != DT_UNKNOWN);
+}
+
+// The color to print an entry of a kind in, if any.
+static const char * kind_color(unsigned char kind) {
+    static const char * colors[] = {
+        0,          // KIND_FILE
+        "\e[33m",   // KIND_FIFO
+        "\e[33;1m", // KIND_CHR
+        "\e[34;1m", // KIND_DIR
+        "\e[33;1m", // KIND_BLK
+        "\e[36;1m", // KIND_LNK
+        "\e[35;1m", // KIND_SOCK
+        "\e[32;1m", // KIND_EXEC
+    };
+
+    return cfg_color ? colors[kind & KIND_MASK] : 0;
+}
+
+// The indicator to print after an entry of a kind, or 0.
+static char kind_indicator(unsigned char kind) {
+    static const char indicators[] = "\0|\0/\0@=*";
+
+    return cfg_indicate ? indicators[kind & KIND_MASK] : 0;
+}
+
+// What text is printed with: a kind to color it as, and how it's highlighted.
+#define ATTR_KIND   0x07 // The kind colored as, if ATTR_COLOR.
+#define ATTR_COLOR  0x08
+#define ATTR_INVERT 0x10
+#define ATTR_BOLD   0x20
+#define ATTR_RED    0x40
+
+// Switch what text is printed with to attr.  Turning anything off, a color
+// included, takes a reset, after which the rest is turned back on.
+static void out_attr(unsigned char attr) {
+    unsigned char from = out.attr;
+
+    if (attr == from) return;
+    if ((from & ~attr) || ((from & ATTR_COLOR) && ((from ^ attr) & ATTR_KIND))) {
+        out_str(ANSI_RESET);
+        from = 0;
+    }
+    if (attr & ~from & ATTR_INVERT) out_str(ANSI_INVERT);
+    if (attr & ~from & ATTR_BOLD)   out_str(ANSI_BOLD);
+    if (attr & ~from & ATTR_COLOR)  out_str(kind_color(attr & ATTR_KIND));
+    if (attr & ~from & ATTR_RED)    out_str(ANSI_RED);
+    out.attr = attr;
+}
+
+// The interactive display is drawn into a grid of cells, the screen as the
+// frame should leave it, and only the cells that differ from a second grid,
+// the screen as the last frame left it, are printed.  Moving the selection
+// or flipping a page costs what changed rather than everything on display.
+
+// Bytes of text a cell holds.  Enough for a code point and marks on it,
+// like the jamo of a decomposed Hangul syllable.  More marks are dropped.
+#define CELL_TEXT_SIZE 13
+
+// Unchanged cells in a row that are printed again rather than moved past.
+// Moving the cursor along a row takes four bytes or more.
+#define GRID_GAP 3
+
+typedef struct cell {
+    char          text[CELL_TEXT_SIZE]; // Not terminated.
+    unsigned char size;  // Bytes of text.  0 for the right half of a wide character.
+    unsigned char width;
+    unsigned char attr;
+} cell;
+
+static const cell cell_blank = { " ", 1, 1, 0 };
+
+static struct {
+    cell * want;   // The next frame.
+    cell * have;   // The last frame, as on the screen.
+    int    rows;
+    int    cols;
+    int    height; // Rows drawn on in want.
+    int    shown;  // Rows drawn on in have.
+    bool   stale;  // The screen isn't as have says, so it's drawn over from scratch.
+} grid;
+
+// Where the display is drawn.  Oneshot output goes straight out,
+// since it's printed once and can be any length.
+static struct {
+    bool          grid; // Draw into the grid instead.
+    bool          clip; // Cut off text at the edge of the grid instead of wrapping it.
+    int           row;  // Where in the grid the next text goes.
+    int           col;  // Counted from one.  Past the last column once that's filled.
+    unsigned char attr;
+} pen;
+
+static bool cell_blank_p(const cell * c) {
+    return c->size == 1 && c->text[0] == ' ' && c->attr == 0;
+}
+
+static bool cell_same(const cell * a, const cell * b) {
+    return a->size == b->size && a->width == b->width && a->attr == b->attr
+        && memcmp(a->text, b->text, a->size) == 0;
+}
+
+static void cells_blank(cell * c, int count) {
+    for (int i = 0; i < count; ++i) c[i] = cell_blank;
+}
+
+// Size the grid to the terminal.  A resized terminal has rearranged
+// what was on it however it likes, so it's drawn over.
+static void grid_resize(int rows, int cols) {
+    size_t count;
+
+    if (rows == grid.rows && cols == grid.cols && grid.want) return;
+
+    count = (size_t)(rows > 0 ? rows : 1) * (cols > 0 ? cols : 1);
+    if ((grid.want = realloc(grid.want, sizeof(cell) * count)) == NULL) exit(1);
+    if ((grid.have = realloc(grid.have, sizeof(cell) * count)) == NULL) exit(1);
+    cells_blank(grid.want, count);
+    cells_blank(grid.have, count);
+
+    grid.rows   = rows;
+    grid.cols   = cols;
+    grid.height = 0;
+    grid.shown  = 0;
+    grid.stale  = true;
+}
+
+// Start the next frame from nothing.
+static void grid_clear() {
+    cells_blank(grid.want, grid.height * grid.cols);
+    grid.height = 0;
+}
+
+static void grid_reach(int row) {
+    if (row < grid.rows && row >= grid.height) grid.height = row + 1;
+}
+
+static void pen_move(int row, int col) {
+    pen.row = row;
+    pen.col = col;
+}
+
+static void pen_attr(unsigned char attr) {
+    pen.attr = attr;
+    if (!pen.grid) out_attr(attr);
+}
+
+// Put a code point of size bytes, width columns wide, at the pen and move
+// it along.  Those that don't fit wrap or are cut off, as on a terminal.
+static void pen_put(const void * text, int size, int width) {
+    cell * at;
+
+    if (!pen.grid) {
+        out_bytes(text, size);
+        return;
+    }
+
+    if (width == 0) {
+        // Marks go on the cell before, or the left half of a wide one.
+        // One that was cut off puts the pen two past the edge, so theirs go too.
+        int col = pen.col - 2;
+
+        if (col < 0 || col >= grid.cols || pen.row >= grid.rows) return;
+        at = grid.want + pen.row * grid.cols + col;
+        if (at->size == 0 && col > 0) --at;
+        if (at->size + size > CELL_TEXT_SIZE) return;
+        memcpy(at->text + at->size, text, size);
+        at->size += size;
+        return;
+    }
+
+    if (pen.col + width - 1 > grid.cols) {
+        if (pen.clip) {
+            pen.col = grid.cols + 2;
+            return;
+        }
+        ++pen.row;
+        pen.col = 1;
+    }
+
+    if (pen.row < grid.rows) {
+        at = grid.want + pen.row * grid.cols + pen.col - 1;
+
+        // Writing over half of a wide character blanks the other half.
+        if (at->size == 0 && pen.col > 1) at[-1] = cell_blank;
+        if (at[width - 1].width == 2 && pen.col + width <= grid.cols) at[width] = cell_blank;
+
+        memcpy(at->text, text, size);
+        at->size  = size;
+        at->width = width;
+        at->attr  = pen.attr;
+        if (width == 2) at[1] = (cell){ "", 0, 0, pen.attr };
+        grid_reach(pen.row);
+    }
+    pen.col += width;
+}
+
+// Put size bytes of text, leaving out anything unprintable.
+static void pen_text(const char * text, int size) {
+    const unsigned char * c   = (const unsigned char *)text;
+    const unsigned char * end = c + size;
+    int                   length;
+
+    if (!pen.grid) {
+        out_bytes(text, size);
+        return;
+    }
+
+    for (; c < end; c += length) {
+        int width = utf8_width(c, &length);
+
+        if (UTF8_PRINTABLE(*c)) pen_put(c, length, width);
+    }
+}
+
+static void pen_str(const char * str) {
+    pen_text(str, strlen(str));
+}
+
+static void pen_int(int n) {
+    char digits[12];
+
+    snprintf(digits, sizeof(digits), "%d", n);
+    pen_str(digits);
+}
+
+static void pen_spaces(int count) {
+    if (!pen.grid) {
+        out_spaces(count);
+        return;
+    }
+    for (int i = 0; i < count; ++i) pen_put(" ", 1, 1);
+}
+
+// A byte that can't be printed, as \XX.
+static void pen_hex(unsigned char c) {
+    static const char hex[] = "0123456789ABCDEF";
+
+    if (!pen.grid) {
+        out_hex(c);
+        return;
+    }
+    pen_put("\\", 1, 1);
+    pen_put(&hex[c >> 4], 1, 1);
+    pen_put(&hex[c & 15], 1, 1);
+}
+
+static void pen_newline() {
+    if (!pen.grid) {
+        out_char('\n');
+        return;
+    }
+    ++pen.row;
+    pen.col = 1;
+    grid_reach(pen.row);
+}
+
+// Blank the rest of the pen's row.
+static void pen_clear_line() {
+    cell * at;
+
+    if (!pen.grid) {
+        out_str("\e[0K");
+        return;
+    }
+    if (pen.row >= grid.rows || pen.col > grid.cols) return;
+
+    at = grid.want + pen.row * grid.cols + pen.col - 1;
+    if (at->size == 0 && pen.col > 1) at[-1] = cell_blank;
+    cells_blank(at, grid.cols - pen.col + 1);
+}
+
+// Print the cells of a row from start up to end.
+static void grid_print(int row, int start, int end) {
+    cell * want = grid.want + row * grid.cols;
+    int    col  = start + 1;
+
+    out_goto(row, col);
+    for (int c = start; c < end; ++c) {
+        if (want[c].size == 0) continue;
+        out_attr(want[c].attr);
+        out_bytes(want[c].text, want[c].size);
+        col += want[c].width;
+#if DEBUG
+        ++stats.frame_cells;
+#endif
+    }
+    // Filling the last column leaves the cursor where it can't be counted on.
+    out.col = col <= grid.cols ? col : 0;
+}
+
+// Print what changed in a row, in runs, and erase what's gone from its end.
+static void grid_flush_row(int row) {
+    cell * want     = grid.want + row * grid.cols;
+    cell * have     = grid.have + row * grid.cols;
+    int    want_end = grid.cols;
+    int    have_end = grid.cols;
+
+    while (want_end > 0 && cell_blank_p(&want[want_end - 1])) --want_end;
+    while (have_end > 0 && cell_blank_p(&have[have_end - 1])) --have_end;
+
+    for (int c = 0; c < want_end;) {
+        int start = c;
+        int end;
+        int same;
+
+        if (cell_same(&want[c], &have[c])) {
+            ++c;
+            continue;
+        }
+
+        for (end = ++c, same = 0; c < want_end && same <= GRID_GAP; ++c) {
+            if (cell_same(&want[c], &have[c])) {
+                ++same;
+            } else {
+                same = 0;
+                end  = c + 1;
+            }
+        }
+
+        // A wide character is printed from its left half.
+        if (want[start].size == 0 && start > 0) --start;
+        grid_print(row, start, end);
+        c = end;
+    }
+
+    if (have_end > want_end) {
+        out_goto(row, want_end + 1);
+        out_attr(0);
+        out_str("\e[0K");
+    }
+}
+
+// Print the differences between the next frame and the last, and make it
+// the last.  The cursor is left on the first column of the top row.
+static void grid_flush() {
+    int  rows   = grid.height > grid.shown ? grid.height : grid.shown;
+    bool synced = sync_output.supported || sync_output.pending;
+
+    // Frames are shown whole where the terminal can, and not torn by its
+    // repainting partway through, for however many writes one is.  Until
+    // it says whether it can, they're bracketed anyway, since terminals
+    // ignore modes they don't know.
+    if (synced) out_str(ANSI_SYNC_BEGIN);
+
+    if (grid.stale) {
+        // Whatever is below the cursor goes, and the display starts over there.
+        out_attr(0);
+        out_str("\r\e[0J");
+        out.row   = 0;
+        out.col   = 1;
+        out.lines = 1;
+        cells_blank(grid.have, grid.shown * grid.cols);
+        grid.stale = false;
+    }
+
+    for (int row = 0; row < rows; ++row) grid_flush_row(row);
+
+    memcpy(grid.have, grid.want, sizeof(cell) * rows * grid.cols);
+    grid.shown = grid.height;
+
+    out_attr(0);
+    out_goto(0, 1);
+
+    if (synced) out_str(ANSI_SYNC_END);
+}
+
+// Allocate size bytes from a listing's arena, growing it if needed.
+// Returns the offset of the allocation, since growing may move the arena.
+static uint32_t listing_alloc(listing * l, size_t size, size_t align) {
+    size_t start = (l->used + align - 1) & ~(align - 1);
+
+    if (start + size > ARENA_MAX_SIZE) {
+        // Offsets must stay 32 bits.  Nothing sane gets here.
+        exit(1);
+    }
+
+    if (l->mem == NULL || start + size > l->size) {
+        size_t new_size = l->size ? l->size : ARENA_MIN_SIZE;
+        while (new_size < start + size) new_size *= 2;
+        if (new_size > ARENA_MAX_SIZE) new_size = ARENA_MAX_SIZE;
+
+        if (l->map) {
+            // A mapped cache file can't grow, so the arena moves to the heap.
+            char * mem = malloc(new_size);
+
+            if (mem == NULL) exit(1);
+            memcpy(mem, l->mem, l->used);
+            munmap(l->map, l->map_size);
+            l->map = NULL;
+            l->mem = mem;
+        } else if ((l->mem = realloc(l->mem, new_size)) == NULL) {
+            exit(1);
+        }
+        l->size = new_size;
+#if DEBUG
+        size_t peak = atomic_load(&stats.arena_peak);
+
+        ++stats.arena_grows;
+        while (new_size > peak && !atomic_compare_exchange_weak(&stats.arena_peak, &peak, new_size)) {}
+#endif
+    }
+
+    l->used = start + size;
+    return start;
+}
+
+// A released listing waits here to be reused,
+// so a scan usually gets the arena of the listing it replaces.
+static _Atomic(listing *) spare_listing = NULL;
+
+static listing * listing_new(unsigned generation) {
+    listing * l = atomic_exchange(&spare_listing, NULL);
+    char *    mem  = NULL;
+    size_t    size = 0;
+
+    if (l) {
+        mem  = l->mem;
+        size = l->size;
+    } else if ((l = malloc(sizeof(*l))) == NULL) {
+        exit(1);
+    }
+
+    memset(l, 0, sizeof(*l));
+    l->mem        = mem;
+    l->size       = size;
+    l->generation = generation;
+    return l;
+}
+
+// Where the entries of a windowed listing are.  See WINDOW_MARK.
+typedef struct spill {
+    FILE *     file;  // Unlinked, so it goes away once closed.
+    uint64_t * marks; // Where every WINDOW_MARK'th entry starts in it.
+    uint64_t   size;  // Bytes in it.
+} spill;
+
+// Release everything in a listing at once.
+// The arena is kept for the next scan unless this listing used only a
+// small part of it, so one huge directory doesn't pin memory forever.
+static void listing_free(listing * l) {
+    if (l == NULL) return;
+
+    if (l->spill) {
+        fclose(l->spill->file);
+        free(l->spill->marks);
+        free(l->spill);
+        l->spill = NULL;
+    }
+
+    if (l->map) {
+        munmap(l->map, l->map_size);
+        l->map  = NULL;
+        l->mem  = NULL;
+        l->size = 0;
+    } else if (l->size > ARENA_MIN_SIZE && l->used < l->size / 4) {
+        free(l->mem);
+        l->mem  = NULL;
+        l->size = 0;
+    }
+    l->used = 0;
+
+    if ((l = atomic_exchange(&spare_listing, l)) != NULL) {
+        free(l->mem);
+        free(l);
+    }
+}
+
+static uint32_t * listing_names(const listing * l) {
+    return (uint32_t *)(l->mem + l->names);
+}
+
+static uint16_t * listing_widths(const listing * l) {
+    return (uint16_t *)(l->mem + l->widths);
+}
+
+static unsigned char * listing_kinds(const listing * l) {
+    return (unsigned char *)(l->mem + l->kinds);
+}
+
+static termpos * listing_cells(const listing * l) {
+    return (termpos *)(l->mem + l->cells);
+}
+
+// Make room for capacity entries in the arrays after the names.
+static void listing_alloc_entries(listing * l, int capacity) {
+    l->widths   = listing_alloc(l, sizeof(uint16_t) * capacity, _Alignof(uint16_t));
+    l->kinds    = listing_alloc(l, capacity, 1);
+    l->cells    = listing_alloc(l, sizeof(termpos) * capacity, _Alignof(termpos));
+    l->capacity = capacity;
+}
+
+static const char * listing_name(const listing * l, int index) {
+    return l->mem + listing_names(l)[index];
+}
+
+static unsigned char listing_type(const listing * l, int index) {
+    // The type is stored in the byte before the name.
+    return listing_name(l, index)[-1];
+}
+
+static const char * entry_name(int index) {
+    return shown->mem + entry_names[index - entry_base];
+}
+
+// Pack a name and its type into the arena.  Returns the offset of the name.
+static uint32_t push_entry_name(listing * l, const char * name, unsigned char type) {
+    size_t   name_size = strlen(name) + 1;
+    uint32_t off       = listing_alloc(l, name_size + 1, 1);
+
+    l->mem[off] = type;
+    memcpy(l->mem + off + 1, name, name_size);
+    return off + 1;
+}
+
+// A fixed pool of worker threads, one per CPU, started on first use.
+// Work is handed out as batches of numbered tasks.  The thread that
+// submits a batch works on it too, so a batch always finishes even when
+// every worker is busy.
+typedef struct pool_batch {
+    void (*task)(void * arg, int index);
+    void * arg;
+    int    count;   // Number of tasks.
+    int    claimed; // Tasks taken by a thread.
+    int    done;    // Tasks finished.
+    struct pool_batch * next;
+} pool_batch;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  work;     // Signalled when a batch is queued.
+    pthread_cond_t  finished; // Signalled when a batch's last task finishes.
+    pool_batch *    queue;    // Batches with unclaimed tasks.
+    int             size;     // Threads working on batches, callers included.
+} pool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+    PTHREAD_COND_INITIALIZER,
+};
+
+// Take the next task of batch.  Must hold pool.lock.
+static int pool_claim(pool_batch * batch) {
+    int index = batch->claimed++;
+
+    if (batch->claimed == batch->count) {
+        // Fully claimed, so nobody else needs to find it.
+        pool_batch ** link = &pool.queue;
+        while (*link != batch) link = &(*link)->next;
+        *link = batch->next;
+    }
+
+    return index;
+}
+
+// Run one task of batch.  Must hold pool.lock, which is released meanwhile.
+static void pool_work(pool_batch * batch) {
+    int index = pool_claim(batch);
+
+    pthread_mutex_unlock(&pool.lock);
+    batch->task(batch->arg, index);
+    pthread_mutex_lock(&pool.lock);
+
+    if (++batch->done == batch->count) pthread_cond_broadcast(&pool.finished);
+}
+
+static void * pool_worker(void * unused) {
+    pthread_mutex_lock(&pool.lock);
+    while (1) {
+        if (pool.queue) pool_work(pool.queue);
+        else pthread_cond_wait(&pool.work, &pool.lock);
+    }
+    return NULL;
+}
+
+static int pool_size() {
+    if (pool.size == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        pool.size = cpus > 1 ? cpus : 1;
+    }
+    return pool.size;
+}
+
+// Run task(arg, 0) through task(arg, count - 1) on the pool and wait for them.
+static void pool_run(void (*task)(void *, int), void * arg, int count) {
+    static bool started = false;
+    pool_batch  batch   = { task, arg, count, 0, 0, NULL };
+    pool_batch ** link;
+
+    if (count <= 0) return;
+
+    pthread_mutex_lock(&pool.lock);
+
+    if (!started) {
+        // The submitting thread is one of the pool's threads.
+        for (int i = 1; i < pool_size(); ++i) {
+            pthread_t thread;
+            if (pthread_create(&thread, NULL, pool_worker, NULL) == 0) {
+                pthread_detach(thread);
+            }
+        }
+        started = true;
+    }
+
+    for (link = &pool.queue; *link; link = &(*link)->next);
+    *link = &batch;
+    pthread_cond_broadcast(&pool.work);
+
+    while (batch.claimed < batch.count) pool_work(&batch);
+    while (batch.done < batch.count) pthread_cond_wait(&pool.finished, &pool.lock);
+
+    pthread_mutex_unlock(&pool.lock);
+}
+
+// What is being sorted.  Keys are offsets of NUL terminated strings from base.
+// When sorting by strxfrm keys, each key is preceded by its name's offset.
+typedef struct sort_ctx {
+    const char *  base;
+    bool          xfrm;       // Keys are strxfrm output rather than the names themselves.
+    atomic_uint * epoch;      // Sorting is abandoned once this moves past generation.
+    unsigned      generation;
+} sort_ctx;
+
+static const unsigned char * sort_key(const sort_ctx * ctx, uint32_t off, size_t depth) {
+    return (const unsigned char *)ctx->base + off + depth;
+}
+
+static const char * sort_key_name(const sort_ctx * ctx, uint32_t off) {
+    return ctx->base + *(const uint32_t *)(ctx->base + off - sizeof(uint32_t));
+}
+
+// Order entries whose sort keys are equal.  Names in a directory are unique,
+// so this only happens when the locale collates different names the same.
+// alphasort leaves their order up to qsort, so any fixed order matches it.
+static void sort_ties(const sort_ctx * ctx, uint32_t * a, size_t n) {
+    if (!ctx->xfrm) return;
+
+    for (size_t i = 1; i < n; ++i) {
+        uint32_t v = a[i];
+        size_t   j = i;
+        for (; j > 0 && strcmp(sort_key_name(ctx, a[j - 1]), sort_key_name(ctx, v)) > 0; --j) {
+            a[j] = a[j - 1];
+        }
+        a[j] = v;
+    }
+}
+
+static int compare_keys(const sort_ctx * ctx, uint32_t x, uint32_t y, size_t depth) {
+    return strcmp((const char *)sort_key(ctx, x, depth), (const char *)sort_key(ctx, y, depth));
+}
+
+static void swap_keys(uint32_t * a, size_t i, size_t j) {
+    uint32_t t = a[i];
+    a[i] = a[j];
+    a[j] = t;
+}
+
+// Multikey quicksort (Bentley and Sedgewick) of NUL terminated keys
+// in the arena, all of which share their first depth bytes.
+static void sort_keys(const sort_ctx * ctx, uint32_t * a, size_t n, size_t depth) {
+    while (n > 1) {
+        if (n > SCAN_CANCEL_CHECK && atomic_load(ctx->epoch) != ctx->generation) return;
+        if (n < SORT_INSERTION_MAX) {
+            for (size_t i = 1; i < n; ++i) {
+                for (size_t j = i; j > 0 && compare_keys(ctx, a[j - 1], a[j], depth) > 0; --j) {
+                    swap_keys(a, j - 1, j);
+                }
+            }
+            // Runs of equal keys are adjacent now.
+            for (size_t i = 0, j; ctx->xfrm && i < n; i = j) {
+                for (j = i + 1; j < n && compare_keys(ctx, a[i], a[j], depth) == 0; ++j);
+                if (j - i > 1) sort_ties(ctx, a + i, j - i);
+            }
+            return;
+        }
+
+        // Partition around the median of three by the byte at depth:
+        // [ == | < | unknown | > | == ], then swap the equal parts to the middle.
+        size_t        m  = n / 2;
+        unsigned char c0 = *sort_key(ctx, a[0], depth);
+        unsigned char cm = *sort_key(ctx, a[m], depth);
+        unsigned char cn = *sort_key(ctx, a[n - 1], depth);
+        size_t        p  = (c0 < cm) ? ((cm < cn) ? m : (c0 < cn) ? n - 1 : 0)
+                                     : ((cm > cn) ? m : (c0 > cn) ? n - 1 : 0);
+        swap_keys(a, 0, p);
+
+        unsigned char pivot = *sort_key(ctx, a[0], depth);
+        size_t lt = 1, i = 1, gt = n - 1, rt = n - 1;
+
+        while (1) {
+            int c;
+            while (i <= gt && (c = *sort_key(ctx, a[i], depth)) <= pivot) {
+                if (c == pivot) swap_keys(a, lt++, i);
+                ++i;
+            }
+            while (i <= gt && (c = *sort_key(ctx, a[gt], depth)) >= pivot) {
+                if (c == pivot) swap_keys(a, gt, rt--);
+                --gt;
+            }
+            if (i > gt) break;
+            swap_keys(a, i++, gt--);
+        }
+
+        size_t less = i - lt;
+        size_t more = rt - gt;
+        size_t k;
+
+        k = lt < less ? lt : less;
+        for (size_t x = 0; x < k; ++x) swap_keys(a, x, i - k + x);
+        k = (n - 1 - rt) < more ? (n - 1 - rt) : more;
+        for (size_t x = 0; x < k; ++x) swap_keys(a, i + x, n - k + x);
+
+        size_t equal = lt + (n - 1 - rt);
+
+        sort_keys(ctx, a, less, depth);
+        sort_keys(ctx, a + n - more, more, depth);
+
+        // Keys equal up to and including depth.
+        a += less;
+        n  = equal;
+        if (pivot == 0) {
+            sort_ties(ctx, a, n);
+            return;
+        }
+        ++depth;
+    }
+}
+
+// Total order of sorted keys, for merging sorted runs.
+static int compare_sorted(const sort_ctx * ctx, uint32_t x, uint32_t y) {
+    int cmp = compare_keys(ctx, x, y, 0);
+
+    if (cmp == 0 && ctx->xfrm) cmp = strcmp(sort_key_name(ctx, x), sort_key_name(ctx, y));
+    return cmp;
+}
+
+// State shared by the tasks of a parallel sort.
+typedef struct parallel_sort {
+    const sort_ctx * ctx;
+    uint32_t * src;
+    uint32_t * dst;
+    size_t     n;
+    int        runs;     // Sorted runs in src.
+    size_t     run_len;  // Length of every run but the last.
+    int        segments; // Output pieces each pair of runs is merged in.
+} parallel_sort;
+
+static void parallel_sort_run(void * arg, int index) {
+    parallel_sort * ps    = arg;
+    size_t          start = ps->run_len * index;
+    size_t          end   = index == ps->runs - 1 ? ps->n : start + ps->run_len;
+
+    sort_keys(ps->ctx, ps->src + start, end - start, 0);
+}
+
+// Merge one segment of one pair of runs from src into dst.
+// Each segment finds where it starts in both runs by binary search,
+// so the segments of a merge are independent of each other.
+static void parallel_sort_merge(void * arg, int index) {
+    parallel_sort * ps      = arg;
+    int             pair    = index / ps->segments;
+    int             segment = index % ps->segments;
+    size_t          a_start = ps->run_len * pair * 2;
+    size_t          b_start = a_start + ps->run_len;
+    size_t          b_end   = b_start + ps->run_len;
+
+    if (b_start > ps->n) b_start = ps->n;
+    if (b_end > ps->n)   b_end   = ps->n;
+
+    uint32_t * a = ps->src + a_start;
+    uint32_t * b = ps->src + b_start;
+    size_t     m = b_start - a_start;
+    size_t     n = b_end - b_start;
+
+    // Output range of this segment, relative to the merged pair.
+    size_t out_start = (m + n) * segment / ps->segments;
+    size_t out_end   = (m + n) * (segment + 1) / ps->segments;
+
+    // Find how many of the first k outputs come from a.
+    size_t splits[2];
+    size_t ks[2] = { out_start, out_end };
+    for (int s = 0; s < 2; ++s) {
+        size_t k  = ks[s];
+        size_t lo = k > n ? k - n : 0;
+        size_t hi = k < m ? k : m;
+        while (lo < hi) {
+            size_t i = lo + (hi - lo) / 2;
+            // Take more from a if a[i] comes before b[k - i - 1].
+            if (compare_sorted(ps->ctx, a[i], b[k - i - 1]) <= 0) lo = i + 1;
+            else hi = i;
+        }
+        splits[s] = lo;
+    }
+
+    size_t     i   = splits[0], i_end = splits[1];
+    size_t     j   = out_start - i, j_end = out_end - i_end;
+    uint32_t * out = ps->dst + a_start + out_start;
+
+    while (i < i_end && j < j_end) {
+        *out++ = compare_sorted(ps->ctx, a[i], b[j]) <= 0 ? a[i++] : b[j++];
+    }
+    while (i < i_end) *out++ = a[i++];
+    while (j < j_end) *out++ = b[j++];
+}
+
+// Sort keys on every thread of the pool: each thread sorts a run,
+// then pairs of runs are merged in parallel until one is left.
+// tmp must have room for n keys.
+static void sort_keys_parallel(const sort_ctx * ctx, uint32_t * keys, uint32_t * tmp, size_t n) {
+    int           threads = pool_size();
+    parallel_sort ps      = { ctx, keys, tmp, n, 0, (n + threads - 1) / threads, 1 };
+
+    ps.runs = (n + ps.run_len - 1) / ps.run_len;
+
+    pool_run(parallel_sort_run, &ps, ps.runs);
+
+    while (ps.runs > 1) {
+        int pairs = (ps.runs + 1) / 2;
+
+        // Split merges up so every thread has one, even on the last pass.
+        ps.segments = threads / pairs > 1 ? threads / pairs : 1;
+        pool_run(parallel_sort_merge, &ps, pairs * ps.segments);
+
+        uint32_t * swap = ps.src;
+        ps.src      = ps.dst;
+        ps.dst      = swap;
+        ps.runs     = pairs;
+        ps.run_len *= 2;
+    }
+
+    if (ps.src != keys) memcpy(keys, ps.src, sizeof(*keys) * n);
+}
+
+// Is the collation order plain byte order?
+static bool collation_is_bytes() {
+    const char * collate = setlocale(LC_COLLATE, NULL);
+    return collate == NULL || strcmp(collate, "C") == 0 || strcmp(collate, "POSIX") == 0;
+}
+
+// Sort keys in a listing's arena, in parallel if there are enough of them.
+// Temporary space is taken from the end of the arena.
+static void sort_arena_keys(listing * l, sort_ctx * ctx, uint32_t keys_off, size_t count) {
+    if (count >= PARALLEL_SORT_MIN && pool_size() > 1) {
+        size_t   mark    = l->used;
+        uint32_t tmp_off = listing_alloc(l, sizeof(uint32_t) * count, _Alignof(uint32_t));
+
+        ctx->base = l->mem;
+        sort_keys_parallel(ctx, (uint32_t *)(l->mem + keys_off),
+                           (uint32_t *)(l->mem + tmp_off), count);
+        l->used = mark;
+    } else {
+        ctx->base = l->mem;
+        sort_keys(ctx, (uint32_t *)(l->mem + keys_off), count, 0);
+    }
+}
+
+// A request for the scanner thread.
+typedef struct scan_job {
+    int           dirfd;      // Where name is looked up.  Owned by the job.
+    char *        name;       // The directory to scan.  Owned by the job.
+    atomic_uint * epoch;      // The counter that cancels this job by moving on.
+    unsigned      generation; // Matches *epoch until the job is superseded.
+    bool          preview;    // Publish previews if the scan is slow.
+    bool          prefetch;   // Scanned ahead of time, for the cache.
+} scan_job;
+
+// Bumped for every scan requested.  Jobs from older generations are cancelled.
+static atomic_uint scan_generation = 0;
+
+// Bumped when the selection moves on, cancelling the prefetch of what it was on.
+// Prefetching the parent directory goes by scan_generation instead.
+static atomic_uint prefetch_generation = 0;
+
+static bool scan_cancelled(const scan_job * job) {
+    return job->generation != atomic_load(job->epoch);
+}
+
+// Sort a listing's names the way alphasort would.
+// Rather than calling strcoll for every comparison, each name's collation
+// key is built once with strxfrm and the keys are sorted as plain bytes.
+// Keys are laid out in the arena after everything else as the name offset
+// followed by the key, and are dropped once sorting is done.
+// Returns false if the job was cancelled first.
+static bool sort_entries(listing * l, const scan_job * job) {
+    sort_ctx ctx        = { NULL, !collation_is_bytes(), job->epoch, job->generation };
+    size_t   keys_start = l->used;
+    uint32_t keys_off;
+    uint32_t * keys;
+
+    if (!ctx.xfrm) {
+        // strcoll is strcmp in the C locale, so the names are the keys.
+        sort_arena_keys(l, &ctx, l->names, l->count);
+        return !scan_cancelled(job);
+    }
+
+    keys_off = listing_alloc(l, sizeof(*keys) * l->count, _Alignof(uint32_t));
+
+    for (int i = 0; i < l->count; ++i) {
+        uint32_t name = listing_names(l)[i];
+        uint32_t off  = listing_alloc(l, sizeof(uint32_t), _Alignof(uint32_t));
+        size_t   room = l->size - l->used;
+        size_t   len  = strxfrm(l->mem + l->used, l->mem + name, room);
+
+        if (len >= room) {
+            // Didn't fit.  Grow, then transform again now that it will.
+            listing_alloc(l, len + 1, 1);
+            l->used -= len + 1;
+            strxfrm(l->mem + l->used, l->mem + name, len + 1);
+        }
+        l->used += len + 1;
+
+        *(uint32_t *)(l->mem + off) = name;
+        ((uint32_t *)(l->mem + keys_off))[i] = off + sizeof(uint32_t);
+
+        if (i % SCAN_CANCEL_CHECK == 0 && scan_cancelled(job)) return false;
+    }
+
+#if DEBUG
+    stats.sort_key_bytes += l->used - keys_start;
+#endif
+
+    sort_arena_keys(l, &ctx, keys_off, l->count);
+    if (scan_cancelled(job)) return false;
+
+    keys = (uint32_t *)(l->mem + keys_off);
+    for (int i = 0; i < l->count; ++i) {
+        listing_names(l)[i] = *(uint32_t *)(l->mem + keys[i] - sizeof(uint32_t));
+    }
+
+    l->used = keys_start;
+    return true;
+}
+
+// Fill in the width and kind of entry index, called name.
+// mode is 0 unless the entry has been stat'd.
+static void measure_entry(listing * l, int index, const char * name, unsigned char type, mode_t mode) {
+    unsigned char kind;
+
+    // Without color or indicators, there's nothing to stat for.
+    if (get_entry_type(type, mode, &kind) || (!cfg_color && !cfg_indicate)) kind |= KIND_TYPED;
+    listing_widths(l)[index] = utf8_len((unsigned char *)name);
+    listing_kinds(l)[index]  = kind | KIND_MEASURED;
+}
+
+// Columns an entry takes on a single line display.
+static int entry_length(const listing * l, int index) {
+    return listing_widths(l)[index] + (kind_indicator(listing_kinds(l)[index]) ? 1 : 0) + ENTRY_DELIM_LEN;
+}
+
+// Color an entry from its mode.  Returns how much its length grew.
+static int type_entry(listing * l, int index, mode_t mode) {
+    int grown = -entry_length(l, index);
+
+    // The mode is the final word on the type, whatever d_type said.
+    l->mem[listing_names(l)[index] - 1] = IFTODT(mode);
+    measure_entry(l, index, listing_name(l, index), IFTODT(mode), mode);
+    return grown + entry_length(l, index);
+}
+
+// Stat the entries from through to that d_type couldn't color, relative
+// to dirfd, the listing's directory.  Doing this only for entries about
+// to be shown saves a syscall for nearly every regular file in a big
+// directory.  Returns how much the listing's total length grew.
+static int type_entries(listing * l, int dirfd, int from, int to) {
+    unsigned char * kinds = listing_kinds(l);
+    int             grown = 0;
+#if DEBUG
+    long            calls = 0;
+#endif
+
+    for (int i = from; i <= to; ++i) {
+        struct stat st;
+
+        if (kinds[i] & KIND_TYPED) continue;
+        kinds[i] |= KIND_TYPED;
+#if DEBUG
+        ++calls;
+#endif
+        if (fstatat(dirfd, listing_name(l, i), &st, AT_SYMLINK_NOFOLLOW) == 0) {
+            grown += type_entry(l, i, st.st_mode);
+        }
+    }
+
+#if DEBUG
+    stats.type_stats += calls;
+#endif
+    return grown;
+}
+
+#if HAVE_IO_URING
+// With io_uring, the stats for a range of entries go to the kernel as
+// batches of statx requests, one syscall per batch, and the kernel works
+// on them in parallel.  Entries are filled in as each completion arrives
+// and the ring is topped up as slots free.  Each thread sets up its own
+// ring the first time, which is freed when the thread exits; if that
+// fails, it goes back to fstatat.  So do entries whose requests fail, and
+// the ring is given up on if the kernel turns out not to do statx through
+// it after all.
+typedef struct meta_ring {
+    int                   fd; // 0 until set up, -1 if io_uring isn't available.
+    char *                sq; // The mappings, to unmap, or NULL.
+    char *                cq;
+    size_t                sq_size;
+    size_t                cq_size;
+    size_t                sqes_size;
+    unsigned *            sq_head;
+    unsigned *            sq_tail;
+    unsigned *            sq_mask;
+    unsigned *            sq_array;
+    unsigned *            cq_head;
+    unsigned *            cq_tail;
+    unsigned *            cq_mask;
+    struct io_uring_sqe * sqes;
+    struct io_uring_cqe * cqes;
+
+    // One result buffer per request in flight.  Free ones are on a stack.
+    struct {
+        int          index; // Entry the request is for, or -1 if it's free.
+        struct statx stx;
+    } slots[META_RING_SIZE];
+    int free[META_RING_SIZE];
+    int free_count;
+} meta_ring;
+
+static _Thread_local meta_ring * meta = NULL;
+static pthread_key_t             meta_key;
+static pthread_once_t            meta_once = PTHREAD_ONCE_INIT;
+
+static void meta_unmap(meta_ring * ring) {
+    if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq && ring->cq != ring->sq) munmap(ring->cq, ring->cq_size);
+    if (ring->sq) munmap(ring->sq, ring->sq_size);
+    ring->sq   = ring->cq = NULL;
+    ring->sqes = NULL;
+}
+
+// Free the ring of a thread that's exiting.  One given up on with requests
+// still in flight is left alone, as meta_abandon explains.
+static void meta_free(void * arg) {
+    meta_ring * ring = arg;
+
+    for (int i = 0; i < META_RING_SIZE; ++i) {
+        if (ring->slots[i].index >= 0) return;
+    }
+    meta_unmap(ring);
+    if (ring->fd >= 0) close(ring->fd);
+    free(ring);
+}
+
+static void meta_key_create(void) {
+    if (pthread_key_create(&meta_key, meta_free) != 0) exit(1);
+}
+
+// Whether the kernel does statx through io_uring.  Those from before 5.6
+// have io_uring without it, and can't be asked either.
+static bool meta_probe() {
+    size_t                  size  = sizeof(struct io_uring_probe)
+                                    + sizeof(struct io_uring_probe_op) * (IORING_OP_STATX + 1);
+    struct io_uring_probe * probe = calloc(1, size);
+    bool                    ok;
+
+    if (probe == NULL) exit(1);
+    ok = syscall(SYS_io_uring_register, meta->fd, IORING_REGISTER_PROBE, probe, IORING_OP_STATX + 1) == 0
+         && probe->last_op >= IORING_OP_STATX
+         && probe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED;
+    free(probe);
+    return ok;
+}
+
+static bool meta_setup() {
+    struct io_uring_params p;
+    size_t sq_size;
+    size_t cq_size;
+    char * sq;
+    char * cq;
+
+    if (meta) return meta->fd >= 0;
+    if ((meta = calloc(1, sizeof(*meta))) == NULL) exit(1);
+    for (int i = 0; i < META_RING_SIZE; ++i) meta->slots[i].index = -1;
+    pthread_once(&meta_once, meta_key_create);
+    pthread_setspecific(meta_key, meta);
+
+    memset(&p, 0, sizeof(p));
+    if ((meta->fd = syscall(SYS_io_uring_setup, META_RING_SIZE, &p)) < 0) return false;
+    if (!meta_probe()) {
+        close(meta->fd);
+        meta->fd = -1;
+        return false;
+    }
+
+    sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (cq_size > sq_size) sq_size = cq_size;
+        cq_size = sq_size;
+    }
+
+    sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+              meta->fd, IORING_OFF_SQ_RING);
+    cq = p.features & IORING_FEAT_SINGLE_MMAP ? sq
+        : mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+               meta->fd, IORING_OFF_CQ_RING);
+    meta->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    meta->sqes      = mmap(NULL, meta->sqes_size, PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_POPULATE, meta->fd, IORING_OFF_SQES);
+
+    meta->sq      = sq == MAP_FAILED ? NULL : sq;
+    meta->cq      = cq == MAP_FAILED ? NULL : cq;
+    meta->sq_size = sq_size;
+    meta->cq_size = cq_size;
+    if (meta->sqes == MAP_FAILED) meta->sqes = NULL;
+    if (!meta->sq || !meta->cq || !meta->sqes) {
+        meta_unmap(meta);
+        close(meta->fd);
+        meta->fd = -1;
+        return false;
+    }
+
+    meta->sq_head  = (unsigned *)(sq + p.sq_off.head);
+    meta->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    meta->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    meta->sq_array = (unsigned *)(sq + p.sq_off.array);
+    meta->cq_head  = (unsigned *)(cq + p.cq_off.head);
+    meta->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    meta->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    meta->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    for (int i = 0; i < META_RING_SIZE; ++i) meta->free[i] = i;
+    meta->free_count = META_RING_SIZE;
+    return true;
+}
+
+// Stop using the ring.  Whatever is in flight is cancelled as it closes,
+// and its entries are left untyped to be done with fstatat.  Slots that
+// were in flight are never freed, even by meta_free, so nothing the
+// kernel still writes lands anywhere used.
+static void meta_abandon(unsigned char * kinds) {
+    for (int i = 0; i < META_RING_SIZE; ++i) {
+        if (meta->slots[i].index >= 0) kinds[meta->slots[i].index] &= ~KIND_TYPED;
+    }
+    close(meta->fd);
+    meta->fd = -1;
+}
+
+// Queue a statx of an entry.  Call only with a free slot.
+static void meta_queue(const listing * l, int dirfd, int index) {
+    unsigned              tail = *meta->sq_tail;
+    unsigned              at   = tail & *meta->sq_mask;
+    int                   slot = meta->free[--meta->free_count];
+    struct io_uring_sqe * sqe  = &meta->sqes[at];
+
+    meta->slots[slot].index = index;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode      = IORING_OP_STATX;
+    sqe->fd          = dirfd;
+    sqe->addr        = (uintptr_t)listing_name(l, index);
+    sqe->len         = STATX_TYPE | STATX_MODE;
+    sqe->off         = (uintptr_t)&meta->slots[slot].stx;
+    sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+    sqe->user_data   = slot;
+
+    meta->sq_array[at] = at;
+    atomic_store_explicit((atomic_uint *)meta->sq_tail, tail + 1, memory_order_release);
+}
+
+// The same as type_entries, through io_uring, adding to grown.
+// Returns false if any entries are left for type_entries.
+static bool meta_type_entries(listing * l, int dirfd, int from, int to, int * grown) {
+    unsigned char * kinds  = listing_kinds(l);
+    int             index  = from;
+    bool            failed = false;
+    bool            broken = false;
+
+    if (!meta_setup()) return false;
+
+    while (1) {
+        unsigned head;
+        unsigned tail;
+        unsigned pending;
+        unsigned wanted;
+
+        for (; index <= to && meta->free_count > 0 && !broken; ++index) {
+            if (kinds[index] & KIND_TYPED) continue;
+            kinds[index] |= KIND_TYPED;
+            meta_queue(l, dirfd, index);
+#if DEBUG
+            ++stats.type_stats;
+#endif
+        }
+
+        if (meta->free_count == META_RING_SIZE) break; // Nothing in flight.
+
+        // Wait for half of what's in flight, so each call submits and reaps
+        // a good batch while the rest keep the kernel busy.
+        pending = *meta->sq_tail - atomic_load_explicit((atomic_uint *)meta->sq_head, memory_order_acquire);
+        wanted  = (META_RING_SIZE - meta->free_count + 1) / 2;
+        if (syscall(SYS_io_uring_enter, meta->fd, pending, wanted, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+            && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            meta_abandon(kinds);
+            return false;
+        }
+#if DEBUG
+        ++stats.meta_enters;
+#endif
+
+        head = *meta->cq_head;
+        tail = atomic_load_explicit((atomic_uint *)meta->cq_tail, memory_order_acquire);
+        for (; head != tail; ++head) {
+            struct io_uring_cqe * cqe   = &meta->cqes[head & *meta->cq_mask];
+            int                   slot  = cqe->user_data;
+            int                   entry = meta->slots[slot].index;
+
+            if (cqe->res == 0) {
+                *grown += type_entry(l, entry, meta->slots[slot].stx.stx_mode);
+            } else {
+                // Left for fstatat, which can say why, or do better.
+                kinds[entry] &= ~KIND_TYPED;
+                failed = true;
+                if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) broken = true;
+            }
+            meta->slots[slot].index        = -1;
+            meta->free[meta->free_count++] = slot;
+        }
+        atomic_store_explicit((atomic_uint *)meta->cq_head, head, memory_order_release);
+    }
+
+    // Nothing is in flight by now.
+    if (broken) meta_abandon(kinds);
+    return !failed;
+}
+#endif
+
+// Measure the entries from through to that haven't been.
+static void measure_range(listing * l, int from, int to) {
+    unsigned char * kinds = listing_kinds(l);
+
+    for (int i = from; i <= to; ++i) {
+        if (!(kinds[i] & KIND_MEASURED)) measure_entry(l, i, listing_name(l, i), listing_type(l, i), 0);
+    }
+}
+
+// Stat entries from through to that d_type couldn't color, however is best.
+static int type_range(listing * l, int dirfd, int from, int to) {
+    int grown = 0;
+
+    measure_range(l, from, to);
+#if HAVE_IO_URING
+    if (to - from + 1 >= META_MIN && meta_type_entries(l, dirfd, from, to, &grown)) return grown;
+#endif
+    return grown + type_entries(l, dirfd, from, to);
+}
+
+typedef struct type_all {
+    listing * l;
+    int       dirfd;
+} type_all;
+
+static void type_all_run(void * arg, int index) {
+    type_all * all  = arg;
+    int        from = index * TYPE_BATCH;
+    int        to   = from + TYPE_BATCH < all->l->count ? from + TYPE_BATCH : all->l->count;
+
+    type_entries(all->l, all->dirfd, from, to - 1);
+}
+
+// Stat every entry that d_type couldn't color.  Without io_uring, or
+// for fewer than META_MIN entries, the stats are spread over the worker
+// pool.
+static void type_listing(listing * l, int dirfd) {
+    type_all all   = { l, dirfd };
+    int      tasks = (l->count + TYPE_BATCH - 1) / TYPE_BATCH;
+#if HAVE_IO_URING
+    int      grown = 0;
+
+    if (l->count >= META_MIN && meta_type_entries(l, dirfd, 0, l->count - 1, &grown)) return;
+#endif
+
+    if (tasks > 1) pool_run(type_all_run, &all, tasks);
+    else           type_entries(l, dirfd, 0, l->count - 1);
+}
+
+// The layout statistics being worked out, from n entries so far.
+typedef struct layout_stats {
+    int  widest;
+    long total_length;
+    int  n;
+} layout_stats;
+
+// Count an entry of length columns, with its indicator and delimiter.
+static void layout_add(layout_stats * s, int length) {
+    if (length - ENTRY_DELIM_LEN > s->widest) s->widest = length - ENTRY_DELIM_LEN;
+
+    s->total_length += length;
+    ++s->n;
+}
+
+// Set l's layout statistics from those counted, scaled up to all its
+// entries if they were a sample.
+static void layout_finish(listing * l, const layout_stats * s) {
+    long total_length = s->total_length;
+
+    if (s->n > 0) total_length = total_length * l->count / s->n;
+
+    l->widest       = s->widest;
+    l->total_length = total_length < INT_MAX ? total_length : INT_MAX;
+}
+
+// Work out the layout statistics from every step'th entry, measuring
+// those that haven't been.  With a step over one, they're an estimate.
+static void listing_layout(listing * l, int step) {
+    const unsigned char * kinds = listing_kinds(l);
+    layout_stats          s     = { 0 };
+
+    for (int i = 0; i < l->count; i += step) {
+        if (!(kinds[i] & KIND_MEASURED)) measure_entry(l, i, listing_name(l, i), listing_type(l, i), 0);
+        layout_add(&s, entry_length(l, i));
+    }
+
+    layout_finish(l, &s);
+}
+
+// Fill in per-entry data and work out the layout statistics.  Big listings
+// get theirs from a sample, and the rest of their entries are left for later.
+// dirfd is the listing's directory.
+// Returns false if the job was cancelled first.
+static bool measure_entries(listing * l, int dirfd, const scan_job * job) {
+    if (l->count > LAYOUT_SAMPLE && !cfg_oneshot) {
+        memset(listing_kinds(l), 0, l->count);
+        l->sampled = true;
+        listing_layout(l, l->count / LAYOUT_SAMPLE);
+#if DEBUG
+        ++stats.layout_samples;
+#endif
+        return true;
+    }
+
+    for (int i = 0; i < l->count; ++i) {
+        if (i % SCAN_CANCEL_CHECK == 0 && scan_cancelled(job)) return false;
+
+        measure_entry(l, i, listing_name(l, i), listing_type(l, i), 0);
+    }
+
+    // Everything gets printed in oneshot mode, so every entry is needed now.
+    if (cfg_oneshot) type_listing(l, dirfd);
+
+    listing_layout(l, 1);
+    return true;
+}
+
+// The order sort_entries leaves names in.
+static int compare_names(const char * a, const char * b) {
+    int cmp = strcoll(a, b);
+    return cmp ? cmp : strcmp(a, b);
+}
+
+// A name listing_update is adding, with the mode fstatat found for it.
+typedef struct added_name {
+    const char * name;
+    mode_t       mode;
+} added_name;
+
+static int compare_added_names(const void * a, const void * b) {
+    return compare_names(((const added_name *)a)->name, ((const added_name *)b)->name);
+}
+
+static int compare_ints(const void * a, const void * b) {
+    return *(const int *)a - *(const int *)b;
+}
+
+// Find a name among a listing's sorted entries.
+// Returns its index, or -1 minus the index it would go at.
+static int listing_find(const listing * l, const char * name) {
+    int lo = 0;
+    int hi = l->count;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = compare_names(listing_name(l, mid), name);
+
+        if (cmp == 0) return mid;
+        if (cmp < 0) lo = mid + 1;
+        else         hi = mid;
+    }
+    return -1 - lo;
+}
+
+// Bring a listing up to date after the given names changed in its
+// directory, dirfd.  Each name must appear once.  Entries are inserted, removed or re-measured in
+// place, keeping them sorted, and the layout statistics are adjusted
+// without being worked out again.
+// Returns the index of the first entry that changed, or -1 if none did,
+// and sets *last to the index of the last.
+static int listing_update(listing * l, int dirfd, const char * const * names, int count, int * last) {
+    int *           removed   = malloc(sizeof(*removed) * count);
+    uint32_t *      added     = malloc(sizeof(*added) * count);
+    mode_t *        modes     = malloc(sizeof(*modes) * count);
+    added_name *    sorted    = malloc(sizeof(*sorted) * count);
+    int             n_removed = 0;
+    int             n_added   = 0;
+    int             old_count = l->count;
+    int             first     = INT_MAX;
+    uint32_t *      index;
+    uint16_t *      widths;
+    unsigned char * kinds;
+    termpos *       cells;
+
+    if (!removed || !added || !modes || !sorted) exit(1);
+    *last = -1;
+
+    for (int n = 0; n < count; ++n) {
+        const char * name = names[n];
+        struct stat st;
+        bool exists = display_filter(name) && fstatat(dirfd, name, &st, AT_SYMLINK_NOFOLLOW) == 0;
+        int  i      = listing_find(l, name);
+
+        if (i >= 0) measure_range(l, i, i);
+
+        if (exists && i >= 0) {
+            // Still there, but its type or permissions may have changed.
+            int           length = entry_length(l, i);
+            int           width  = listing_widths(l)[i];
+            unsigned char kind   = listing_kinds(l)[i] & KIND_MASK;
+
+            l->mem[listing_names(l)[i] - 1] = IFTODT(st.st_mode);
+            measure_entry(l, i, name, IFTODT(st.st_mode), st.st_mode);
+            if (listing_widths(l)[i] != width || (listing_kinds(l)[i] & KIND_MASK) != kind) {
+                l->total_length += entry_length(l, i) - length;
+                if (i < first)  first = i;
+                if (i > *last) *last  = i;
+            }
+        } else if (exists) {
+            modes[n_added]   = st.st_mode;
+            added[n_added++] = push_entry_name(l, name, IFTODT(st.st_mode));
+        } else if (i >= 0) {
+            removed[n_removed++] = i;
+        }
+    }
+
+    if (n_removed > 0) {
+        int j = 0;
+
+        qsort(removed, n_removed, sizeof(*removed), compare_ints);
+        index  = listing_names(l);
+        widths = listing_widths(l);
+        kinds  = listing_kinds(l);
+        cells  = listing_cells(l);
+
+        for (int i = 0, r = 0; i < l->count; ++i) {
+            if (r < n_removed && removed[r] == i) {
+                l->total_length -= entry_length(l, i);
+                l->garbage      += strlen(l->mem + index[i]) + 2;
+                ++r;
+                continue;
+            }
+            index[j]  = index[i];
+            widths[j] = widths[i];
+            kinds[j]  = kinds[i];
+            cells[j]  = cells[i];
+            ++j;
+        }
+
+        l->count = j;
+        if (removed[0] < first) first = removed[0];
+    }
+
+    if (n_added > 0) {
+        int new_count = l->count + n_added;
+
+        if (new_count > l->capacity) {
+            // Move the arrays to the end of the arena with room to spare.
+            int      capacity   = new_count + new_count / 2;
+            uint32_t old_names  = l->names;
+            uint32_t old_widths = l->widths;
+            uint32_t old_kinds  = l->kinds;
+            uint32_t old_cells  = l->cells;
+
+            l->garbage += (sizeof(uint32_t) + sizeof(uint16_t) + 1 + sizeof(termpos)) * l->capacity;
+            l->names    = listing_alloc(l, sizeof(uint32_t) * capacity, _Alignof(uint32_t));
+            listing_alloc_entries(l, capacity);
+            memcpy(listing_names(l), l->mem + old_names, sizeof(uint32_t) * l->count);
+            memcpy(listing_widths(l), l->mem + old_widths, sizeof(uint16_t) * l->count);
+            memcpy(listing_kinds(l), l->mem + old_kinds, l->count);
+            memcpy(listing_cells(l), l->mem + old_cells, sizeof(termpos) * l->count);
+        }
+
+        // The arena doesn't move from here on, so sort the new names by address.
+        for (int j = 0; j < n_added; ++j) sorted[j] = (added_name){ l->mem + added[j], modes[j] };
+        qsort(sorted, n_added, sizeof(*sorted), compare_added_names);
+
+        // Merge them in from the back.
+        index  = listing_names(l);
+        widths = listing_widths(l);
+        kinds  = listing_kinds(l);
+        cells  = listing_cells(l);
+
+        for (int i = l->count - 1, j = n_added - 1, k = new_count - 1; j >= 0; --k) {
+            if (i >= 0 && compare_names(l->mem + index[i], sorted[j].name) > 0) {
+                index[k]  = index[i];
+                widths[k] = widths[i];
+                kinds[k]  = kinds[i];
+                cells[k]  = cells[i];
+                --i;
+            } else {
+                // The mode is already known, so the entry needn't be stat'd again.
+                index[k] = sorted[j].name - l->mem;
+                measure_entry(l, k, sorted[j].name, sorted[j].name[-1], sorted[j].mode);
+                l->total_length += entry_length(l, k);
+                if (k < first) first = k;
+                --j;
+            }
+        }
+
+        l->count = new_count;
+    }
+
+    // Everything after an insert or remove has moved.
+    if (n_removed > 0 || n_added > 0) *last = (l->count > old_count ? l->count : old_count) - 1;
+
+    free(removed);
+    free(added);
+    free(modes);
+    free(sorted);
+    return first == INT_MAX ? -1 : first;
+}
+
+static long ms_since(const struct timespec * then) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * 1000 + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+// Finished listings and previews are handed from the scanner thread
+// to the display through this slot.  Whoever swaps a listing out owns it.
+static _Atomic(listing *) scan_result = NULL;
+
+// Prefetched listings wait here for the display to cache them,
+// pushed onto a stack linked through their older fields.
+static _Atomic(listing *) prefetch_results = NULL;
+
+// Written to when scan_result is filled, to wake up the input loop.
+static int scan_wake[2] = { -1, -1 };
+
+static void scan_publish(listing * l) {
+    char wake = 0;
+
+    if (l->prefetched) {
+        l->older = atomic_load(&prefetch_results);
+        while (!atomic_compare_exchange_weak(&prefetch_results, &l->older, l));
+    } else {
+        // A listing the display never took is out of date now.
+        listing_free(atomic_exchange(&scan_result, l));
+    }
+    if (write(scan_wake[1], &wake, 1) < 0) {
+        // The pipe is full, so the display has wake-ups pending anyway.
+    }
+}
+
+// While a slow scan is running, previews of the first page are sent
+// to the display, made from the entries read so far.
+// A preview holds the names that sort first out of those seen,
+// so it settles into the real first page as the scan goes on.
+// Only the scanner thread touches this.
+static struct {
+    bool            enabled;  // Previews may be sent for this scan.
+    bool            shown;    // A preview has been sent for this scan.
+    struct timespec start;    // When the scan started.
+    struct timespec drawn;    // When the last preview was sent.
+    uint32_t *      names;    // Sorted name offsets into the scan's arena.
+    int             count;
+    int             capacity; // At least as many entries as fit on screen.
+} preview;
+
+static void preview_begin(const scan_job * job) {
+    struct winsize size;
+
+    preview.enabled = job->preview;
+    preview.shown   = false;
+    preview.count   = 0;
+    clock_gettime(CLOCK_MONOTONIC, &preview.start);
+
+    if (!preview.enabled) return;
+
+    // Every entry takes at least a column and a delimiter.
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) < 0) {
+        preview.enabled = false;
+        return;
+    }
+    int capacity = size.ws_row * (size.ws_col / (ENTRY_DELIM_LEN + 1) + 1);
+
+    if (capacity > preview.capacity) {
+        preview.names = realloc(preview.names, sizeof(*preview.names) * capacity);
+        if (preview.names == NULL) exit(1);
+        preview.capacity = capacity;
+    }
+}
+
+// Consider a newly read entry of l for the preview.
+static void preview_add(const listing * l, uint32_t name) {
+    const char * str = l->mem + name;
+    int i = preview.count;
+
+    if (i == preview.capacity) {
+        // Full, so only keep it if it comes before the last one.
+        if (strcoll(str, l->mem + preview.names[i - 1]) >= 0) return;
+        --i;
+    } else {
+        ++preview.count;
+    }
+
+    for (; i > 0 && strcoll(str, l->mem + preview.names[i - 1]) < 0; --i) {
+        preview.names[i] = preview.names[i - 1];
+    }
+    preview.names[i] = name;
+}
+
+// Send a preview of the scan into l so far to the display.
+static void preview_send(const scan_job * job, const listing * l, int dirfd, int scanned, bool sorting) {
+    listing * p = listing_new(job->generation);
+
+    p->count   = preview.count;
+    p->names   = listing_alloc(p, sizeof(uint32_t) * p->count, _Alignof(uint32_t));
+    p->partial = true;
+    p->sorting = sorting;
+    p->scanned = scanned;
+
+    for (int i = 0; i < p->count; ++i) {
+        const char * name = l->mem + preview.names[i];
+        uint32_t     off  = push_entry_name(p, name, name[-1]);
+        listing_names(p)[i] = off;
+    }
+
+    listing_alloc_entries(p, p->count);
+    measure_entries(p, dirfd, job);
+
+    scan_publish(p);
+    clock_gettime(CLOCK_MONOTONIC, &preview.drawn);
+}
+
+// Called after each batch of entries is read.
+// Names of the entries kept so far start at names_start in the arena.
+static void preview_batch(const scan_job * job, const listing * l, int dirfd,
+                          uint32_t names_start, int count) {
+    if (!preview.enabled) return;
+
+    if (!preview.shown) {
+        if (ms_since(&preview.start) < SCAN_PREVIEW_DELAY_MS) return;
+
+        // Catch up on everything read before the scan was found to be slow.
+        for (uint32_t off = names_start; off < l->used;) {
+            preview_add(l, off + 1);
+            off += strlen(l->mem + off + 1) + 2;
+        }
+        preview.shown = true;
+    } else if (ms_since(&preview.drawn) < SCAN_PREVIEW_INTERVAL_MS) {
+        return;
+    }
+
+    preview_send(job, l, dirfd, count, false);
+}
+
+// Record that a listing matches its directory as st describes it.
+static void listing_stamp(listing * l, const struct stat * st) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+
+    l->dev   = st->st_dev;
+    l->ino   = st->st_ino;
+    l->mtime = st->st_mtim;
+    l->ctime = st->st_ctim;
+    l->cacheable = (now.tv_sec - st->st_ctim.tv_sec) * 1000
+        + (now.tv_nsec - st->st_ctim.tv_nsec) / 1000000 > LISTING_CACHE_RACY_MS;
+}
+
+// Point l's name offsets at the count names packed from start to end.
+static void listing_index(listing * l, uint32_t start, uint32_t end, int count) {
+    l->names = listing_alloc(l, sizeof(uint32_t) * count, _Alignof(uint32_t));
+
+    for (uint32_t off = start, i = 0; off < end; ++i) {
+        listing_names(l)[i] = off + 1;
+        off += strlen(l->mem + off + 1) + 2;
+    }
+}
+
+// Put $XDG_CACHE_HOME/peek, or ~/.cache/peek, in path.  With create, it's
+// made if need be.  Returns its length, or -1 if there's no such place or
+// it doesn't leave room for size - 64 more bytes.
+static int cache_dir(char * path, size_t size, bool create) {
+    const char * base = getenv("XDG_CACHE_HOME");
+    const char * home = getenv("HOME");
+    int          len;
+
+    if (base && base[0] == '/')    len = snprintf(path, size, "%s/peek", base);
+    else if (home && home[0] == '/') len = snprintf(path, size, "%s/.cache/peek", home);
+    else                           return -1;
+    if (len < 0 || (size_t)len + 64 > size) return -1;
+
+    if (create) {
+        char * slash = strrchr(path, '/');
+
+        *slash = 0;
+        mkdir(path, 0700);
+        *slash = '/';
+        mkdir(path, 0700);
+    }
+    return len;
+}
+
+// An unlinked temporary file for a windowed scan, or NULL.  They go with
+// the cache files rather than in $TMPDIR, since /tmp is often in memory,
+// which is what windowing is meant to spare.
+static FILE * spill_file() {
+    const char * dir = getenv("TMPDIR");
+    char         path[PATH_MAX];
+    FILE *       f;
+    int          len = cache_dir(path, sizeof(path), true);
+    int          fd  = -1;
+
+    if (len >= 0) {
+        strcpy(path + len, "/spill-XXXXXX");
+        fd = mkstemp(path);
+    }
+    if (fd < 0) {
+        snprintf(path, sizeof(path), "%s/peek-XXXXXX", dir && dir[0] == '/' ? dir : "/tmp");
+        if ((fd = mkstemp(path)) < 0) return NULL;
+    }
+    unlink(path);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    if ((f = fdopen(fd, "w+")) == NULL) close(fd);
+    return f;
+}
+
+// The sorted runs a windowed scan has written so far, each of them its
+// entries packed the way the arena has them.
+typedef struct spill_runs {
+    FILE ** files;
+    int     count;
+    int     entries; // Entries written to them.
+    bool    failed;  // Temporary files can't be written, so the rest stays in memory.
+} spill_runs;
+
+static void spill_runs_close(spill_runs * runs) {
+    for (int i = 0; i < runs->count; ++i) fclose(runs->files[i]);
+    free(runs->files);
+}
+
+// Move the names kept for the preview to the start of l's arena,
+// which is being emptied.  Returns where the names after them begin.
+static uint32_t preview_keep(listing * l) {
+    size_t size = 1;
+    char * keep;
+    char * p;
+
+    for (int i = 0; i < preview.count; ++i) size += strlen(l->mem + preview.names[i]) + 2;
+    if ((keep = malloc(size)) == NULL) exit(1);
+
+    p = keep;
+    for (int i = 0; i < preview.count; ++i) {
+        const char * name = l->mem + preview.names[i];
+        size_t       len  = strlen(name) + 2;
+
+        memcpy(p, name - 1, len);
+        p += len;
+    }
+
+    l->used = 0;
+    p = keep;
+    for (int i = 0; i < preview.count; ++i) {
+        preview.names[i] = push_entry_name(l, p + 1, p[0]);
+        p += strlen(p + 1) + 2;
+    }
+
+    free(keep);
+    return l->used;
+}
+
+// Called after each batch of entries is read, count of them so far.
+// Once the names read since *names_start take more than the memory budget,
+// they're sorted and written out as a run, and the arena is emptied.
+// Returns false if the job was cancelled first, or is a prefetch, which
+// wouldn't be cached anyway.
+static bool spill_batch(const scan_job * job, listing * l, spill_runs * runs,
+                        uint32_t * names_start, int count) {
+    uint32_t names_end = l->used;
+    FILE *   f;
+    bool     ok = true;
+
+    if (runs->failed || names_end - *names_start <= cfg_memory_budget) return true;
+    if (job->prefetch) return false;
+
+    if ((f = spill_file()) == NULL) {
+        runs->failed = true;
+        return true;
+    }
+
+    l->count = count - runs->entries;
+    listing_index(l, *names_start, names_end, l->count);
+    if (!sort_entries(l, job)) {
+        fclose(f);
+        return false;
+    }
+
+    for (int i = 0; i < l->count && ok; ++i) {
+        const char * name = listing_name(l, i);
+        ok = fwrite(name - 1, 1, strlen(name) + 2, f) > 0;
+    }
+
+    if (!ok || fflush(f) != 0) {
+        // Out of disk.  Keep what's read in memory after all.
+        fclose(f);
+        runs->failed = true;
+        l->used = names_end;
+        return true;
+    }
+
+    runs->files = realloc(runs->files, sizeof(*runs->files) * (runs->count + 1));
+    if (runs->files == NULL) exit(1);
+    runs->files[runs->count++] = f;
+    runs->entries = count;
+#if DEBUG
+    ++stats.window_runs;
+#endif
+
+    *names_start = preview_keep(l);
+    return true;
+}
+
+// The next entry to merge from a run, or from the sorted listing in memory.
+typedef struct spill_head {
+    FILE *        file; // NULL for the listing.
+    int           next; // For the listing, the index of the next entry.
+    char *        buf;
+    size_t        size;
+    char *        name;
+    unsigned char type;
+} spill_head;
+
+// Move a head on to its next entry.  Returns false if there isn't one.
+static bool spill_next(spill_head * h, const listing * l) {
+    int type;
+
+    if (h->file == NULL) {
+        if (h->next == l->count) return false;
+        h->name = l->mem + listing_names(l)[h->next++];
+        h->type = h->name[-1];
+        return true;
+    }
+
+    if ((type = getc(h->file)) == EOF || getdelim(&h->buf, &h->size, 0, h->file) <= 0) return false;
+    h->name = h->buf;
+    h->type = type;
+    return true;
+}
+
+// Restore the heap order of heads from heap[i] down.
+static void spill_sift(const spill_head * heads, int * heap, int n, int i) {
+    while (1) {
+        int least = i;
+        int child = 2 * i + 1;
+        int tmp;
+
+        for (int c = child; c < n && c <= child + 1; ++c) {
+            if (compare_names(heads[heap[c]].name, heads[heap[least]].name) < 0) least = c;
+        }
+        if (least == i) return;
+
+        tmp         = heap[i];
+        heap[i]     = heap[least];
+        heap[least] = tmp;
+        i = least;
+    }
+}
+
+// Read entries of a windowed listing into its arena in place of the ones
+// there: from the mark at or before from through to, and at least
+// WINDOW_SIZE of them.
+static void window_load(listing * l, int from, int to) {
+    spill *  s     = l->spill;
+    int      first = from / WINDOW_MARK * WINDOW_MARK;
+    int      end   = first + WINDOW_SIZE > to + 1 ? first + WINDOW_SIZE : to + 1;
+    uint64_t start;
+    uint64_t stop;
+    uint32_t names;
+
+    end   = (end + WINDOW_MARK - 1) / WINDOW_MARK * WINDOW_MARK;
+    if (end > l->count) end = l->count;
+    start = s->marks[first / WINDOW_MARK];
+    stop  = end < l->count ? s->marks[end / WINDOW_MARK] : s->size;
+
+    l->used = 0;
+    names   = listing_alloc(l, stop - start, 1);
+    // The file was written by this process.  Losing it is like running out of memory.
+    if (pread(fileno(s->file), l->mem + names, stop - start, start) != (ssize_t)(stop - start)) exit(1);
+
+    listing_index(l, names, names + (stop - start), end - first);
+    listing_alloc_entries(l, end - first);
+    memset(listing_kinds(l), 0, end - first);
+    l->base     = first;
+    l->resident = end - first;
+#if DEBUG
+    ++stats.window_loads;
+#endif
+}
+
+// Merge the runs of a windowed scan with the sorted listing l into one
+// file, and make l a window onto it.  The layout statistics are worked
+// out along the way, so they're exact.  If the file can't be written,
+// l is left as a directory that couldn't be read.
+// Returns false if the job was cancelled first.
+static bool spill_merge(listing * l, const scan_job * job, spill_runs * runs) {
+    int          total = runs->entries + l->count;
+    spill_head * heads = calloc(runs->count + 1, sizeof(*heads));
+    int *        heap  = malloc(sizeof(*heap) * (runs->count + 1));
+    uint64_t *   marks = malloc(sizeof(*marks) * (total / WINDOW_MARK + 1));
+    FILE *       out   = spill_file();
+    layout_stats ls    = { 0 };
+    uint64_t     off   = 0;
+    bool         ok    = out != NULL;
+    int          n     = 0;
+    int          i     = 0;
+
+    if (heads == NULL || heap == NULL || marks == NULL) exit(1);
+
+    for (int r = 0; r <= runs->count; ++r) {
+        heads[r].file = r < runs->count ? runs->files[r] : NULL;
+        if (heads[r].file) rewind(heads[r].file);
+        if (spill_next(&heads[r], l)) heap[n++] = r;
+    }
+    for (int h = n / 2 - 1; h >= 0; --h) spill_sift(heads, heap, n, h);
+
+    while (ok && n > 0) {
+        spill_head *  h     = &heads[heap[0]];
+        size_t        size  = strlen(h->name) + 1;
+        int           width = utf8_len((unsigned char *)h->name);
+        unsigned char kind;
+
+        if (i % WINDOW_MARK == 0) marks[i / WINDOW_MARK] = off;
+        putc(h->type, out);
+        ok   = fwrite(h->name, 1, size, out) == size;
+        off += size + 1;
+
+        get_entry_type(h->type, 0, &kind);
+        layout_add(&ls, width + (kind_indicator(kind) ? 1 : 0) + ENTRY_DELIM_LEN);
+
+        if (!spill_next(h, l)) heap[0] = heap[--n];
+        spill_sift(heads, heap, n, 0);
+
+        if (++i % SCAN_CANCEL_CHECK == 0 && scan_cancelled(job)) break;
+    }
+
+    for (int r = 0; r < runs->count; ++r) {
+        if (ferror(heads[r].file)) ok = false;
+        free(heads[r].buf);
+    }
+    free(heads);
+    free(heap);
+
+    if (n > 0 && ok) {
+        fclose(out);
+        free(marks);
+        return false;
+    }
+
+    if (!ok || i != total || fflush(out) != 0) {
+        if (out) fclose(out);
+        free(marks);
+        l->used  = 0;
+        l->count = -1;
+        return true;
+    }
+
+    if ((l->spill = malloc(sizeof(*l->spill))) == NULL) exit(1);
+    l->spill->file  = out;
+    l->spill->marks = marks;
+    l->spill->size  = off;
+    l->count        = total;
+    layout_finish(l, &ls);
+    window_load(l, 0, 0);
+#if DEBUG
+    ++stats.windowed;
+#endif
+    return true;
+}
+
+// Read the entries of the job's directory, keeping only those
+// that pass display_filter, then index, sort and measure them.
+// Directories too big for memory are windowed.  See WINDOW_MARK.
+// Returns NULL if the job was cancelled before finishing.
+static listing * scan_directory(const scan_job * job) {
+    listing *  l = listing_new(job->generation);
+    uint32_t   names_start = 0;
+    uint32_t   names_end;
+    int        count = 0;
+    int        fd;
+    spill_runs runs = { 0 };
+    struct stat st;
+#if DEBUG
+    struct timespec scan_start;
+    clock_gettime(CLOCK_MONOTONIC, &scan_start);
+#endif
+
+    fd = openat(job->dirfd, job->name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+        l->count = -1;
+        return l;
+    }
+
+    if (fstat(fd, &st) == 0) listing_stamp(l, &st);
+
+    preview_begin(job);
+
+#if defined(__linux__)
+    char * batch = malloc(SCAN_BATCH_SIZE);
+    if (batch == NULL) exit(1);
+
+    while (1) {
+        long nread = syscall(SYS_getdents64, fd, batch, SCAN_BATCH_SIZE);
+#if DEBUG
+        ++stats.scan_syscalls;
+#endif
+        if (nread < 0) {
+            free(batch);
+            close(fd);
+            spill_runs_close(&runs);
+            l->used  = 0;
+            l->count = -1;
+            return l;
+        }
+        if (nread == 0) break;
+        if (scan_cancelled(job)) {
+            free(batch);
+            close(fd);
+            spill_runs_close(&runs);
+            listing_free(l);
+            return NULL;
+        }
+
+        for (char * rec = batch, * end = batch + nread; rec < end;) {
+            scan_entry * ent = (scan_entry *)rec;
+
+#if DEBUG
+            ++stats.scan_entries;
+#endif
+            if (display_filter(ent->d_name)) {
+                uint32_t name = push_entry_name(l, ent->d_name, ent->d_type);
+                if (preview.shown) preview_add(l, name);
+                ++count;
+            }
+            rec += ent->d_reclen;
+        }
+
+        preview_batch(job, l, fd, names_start, count);
+        if (!spill_batch(job, l, &runs, &names_start, count)) {
+            free(batch);
+            close(fd);
+            spill_runs_close(&runs);
+            listing_free(l);
+            return NULL;
+        }
+    }
+    free(batch);
+#else
+    DIR * dir = fdopendir(dup(fd));
+    struct dirent * dent;
+    bool stopped = false;
+
+    if (dir == NULL) {
+        close(fd);
+        l->count = -1;
+        return l;
+    }
+
+    while ((dent = readdir(dir)) != NULL) {
+#if DEBUG
+        ++stats.scan_entries;
+#endif
+        if (display_filter(dent->d_name)) {
+            uint32_t name = push_entry_name(l, dent->d_name, dent->d_type);
+            if (preview.shown) preview_add(l, name);
+            ++count;
+        }
+
+        // readdir has no batches, so check in every so often.
+        if (count % SCAN_CANCEL_CHECK == 0) {
+            if ((stopped = scan_cancelled(job))) break;
+            preview_batch(job, l, fd, names_start, count);
+            if ((stopped = !spill_batch(job, l, &runs, &names_start, count))) break;
+        }
+    }
+    closedir(dir);
+
+    if (stopped || scan_cancelled(job)) {
+        close(fd);
+        spill_runs_close(&runs);
+        listing_free(l);
+        return NULL;
+    }
+#endif
+
+    names_end = l->used;
+
+    if (preview.shown) preview_send(job, l, fd, count, true);
+
+    // The name offsets and the per-entry arrays go in the arena after the names.
+    // Those read since the last run, if there were any.
+    l->count = count - runs.entries;
+    listing_index(l, names_start, names_end, l->count);
+    if (runs.count == 0) listing_alloc_entries(l, l->count);
+
+    if (!sort_entries(l, job)
+        || (runs.count > 0 ? !spill_merge(l, job, &runs) : !measure_entries(l, fd, job))) {
+        close(fd);
+        spill_runs_close(&runs);
+        listing_free(l);
+        return NULL;
+    }
+    close(fd);
+    spill_runs_close(&runs);
+
+#if DEBUG
+    ++stats.scans;
+    stats.scan_ms += ms_since(&scan_start);
+    if (runs.count == 0) {
+        stats.arena_names += names_end - names_start;
+        stats.arena_index += l->used - names_end;
+    }
+#endif
+
+    return l;
+}
+
+// Make a job to scan name in the directory on display.
+static scan_job scan_job_new(const char * name) {
+    scan_job job = { 0 };
+
+    job.dirfd = fcntl(current_fd, F_DUPFD_CLOEXEC, 0);
+    job.name  = strdup(name);
+    if (job.dirfd < 0 || job.name == NULL) exit(1);
+    return job;
+}
+
+static void scan_job_release(scan_job * job) {
+    close(job->dirfd);
+    free(job->name);
+}
+
+// The scanner thread runs one job at a time, newest first.
+// Prefetches only run while there's no scan for the display waiting,
+// so they never hold one up for longer than a cancellation check.
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  wake;
+    scan_job        next;
+    bool            has_next;
+    scan_job        prefetch[PREFETCH_MAX];
+    int             prefetch_count;
+    bool            started;
+} scanner = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static void * scanner_main(void * unused) {
+    while (1) {
+        scan_job  job;
+        listing * l = NULL;
+
+        pthread_mutex_lock(&scanner.lock);
+        while (!scanner.has_next && scanner.prefetch_count == 0) {
+            pthread_cond_wait(&scanner.wake, &scanner.lock);
+        }
+        if (scanner.has_next) {
+            job = scanner.next;
+            scanner.has_next = false;
+        } else {
+            job = scanner.prefetch[0];
+            memmove(scanner.prefetch, scanner.prefetch + 1, --scanner.prefetch_count * sizeof(job));
+        }
+        pthread_mutex_unlock(&scanner.lock);
+
+        if (!scan_cancelled(&job)) l = scan_directory(&job);
+        if (l) {
+            l->prefetched = job.prefetch;
+            scan_publish(l);
+        }
+#if DEBUG
+        if (job.prefetch) {
+            if (l) ++stats.prefetches;
+            else   ++stats.prefetch_cancels;
+        }
+#endif
+        scan_job_release(&job);
+    }
+    return NULL;
+}
+
+// Start the scanner thread if it isn't running yet.  Call with scanner.lock held.
+static void scanner_start() {
+    pthread_t thread;
+
+    if (scanner.started) return;
+
+    if (pipe(scan_wake) < 0
+        || fcntl(scan_wake[0], F_SETFL, O_NONBLOCK) < 0
+        || fcntl(scan_wake[1], F_SETFL, O_NONBLOCK) < 0
+        || pthread_create(&thread, NULL, scanner_main, NULL) != 0) {
+        exit(1);
+    }
+    pthread_detach(thread);
+    scanner.started = true;
+}
+
+// Listings of directories left behind, most recently shown first,
+// so going back to one doesn't scan it again.  A cached listing is only
+// used if the directory's mtime and ctime haven't changed since its scan.
+// Only the UI thread touches the cache.
+static struct {
+    listing * newest;
+    listing * oldest;
+    size_t    size; // Bytes held, arenas included.
+} cache;
+
+static size_t listing_footprint(const listing * l) {
+    return sizeof(*l) + l->size;
+}
+
+static void cache_unlink(listing * l) {
+    if (l->newer) l->newer->older = l->older;
+    else          cache.newest    = l->older;
+    if (l->older) l->older->newer = l->newer;
+    else          cache.oldest    = l->newer;
+
+    l->newer = l->older = NULL;
+    cache.size -= listing_footprint(l);
+}
+
+// Keep a listing for later, or release it if it can't be reused.
+static void cache_put(listing * l) {
+    if (l == NULL) return;
+
+    if (l->partial || l->count < 0 || !l->cacheable || l->spill) {
+        listing_free(l);
+        return;
+    }
+
+    // Cached listings never grow again, so drop the unused end of the arena.
+    if (l->map == NULL && l->used > 0 && l->used < l->size) {
+        char * mem = realloc(l->mem, l->used);
+        if (mem) {
+            l->mem  = mem;
+            l->size = l->used;
+        }
+    }
+
+    if (listing_footprint(l) > cfg_memory_budget / 2) {
+        listing_free(l);
+        return;
+    }
+
+    for (listing * c = cache.newest; c; c = c->older) {
+        if (c->dev == l->dev && c->ino == l->ino) {
+            cache_unlink(c);
+            listing_free(c);
+            break;
+        }
+    }
+
+    while (cache.size + listing_footprint(l) > cfg_memory_budget / 2) {
+        listing * c = cache.oldest;
+        cache_unlink(c);
+        listing_free(c);
+#if DEBUG
+        ++stats.cache_evictions;
+#endif
+    }
+
+    l->older = cache.newest;
+    if (cache.newest) cache.newest->newer = l;
+    else              cache.oldest        = l;
+    cache.newest = l;
+    cache.size  += listing_footprint(l);
+#if DEBUG
+    if (cache.size > stats.cache_peak) stats.cache_peak = cache.size;
+#endif
+}
+
+// Find the cached listing of the directory st describes.
+// One that turns out to be out of date is dropped.
+static listing * cache_find(const struct stat * st) {
+    listing * l = cache.newest;
+
+    while (l && (l->dev != st->st_dev || l->ino != st->st_ino)) l = l->older;
+
+    if (l && (l->mtime.tv_sec  != st->st_mtim.tv_sec || l->mtime.tv_nsec != st->st_mtim.tv_nsec
+            || l->ctime.tv_sec != st->st_ctim.tv_sec || l->ctime.tv_nsec != st->st_ctim.tv_nsec)) {
+        cache_unlink(l);
+        listing_free(l);
+        l = NULL;
+#if DEBUG
+        ++stats.cache_stale;
+#endif
+    }
+
+    return l;
+}
+
+// Take the cached listing of the directory st describes, if it's still valid.
+static listing * cache_take(const struct stat * st) {
+    listing * l = cache_find(st);
+
+    if (l) cache_unlink(l);
+
+#if DEBUG
+    if (l) ++stats.cache_hits;
+    else   ++stats.cache_misses;
+#endif
+    return l;
+}
+
+// Move prefetched listings into the cache.
+static void take_prefetch_results() {
+    listing * l = atomic_exchange(&prefetch_results, NULL);
+
+    while (l) {
+        listing * next = l->older;
+        l->older = NULL;
+        cache_put(l);
+        l = next;
+    }
+}
+
+// Listings of big directories are kept on disk between runs, so starting
+// in one paints straight away from the last run's listing while a scan
+// checks it in the background.  A cache file holds a listing's arena as
+// it is, after a header saying what it's a listing of, and is mapped in
+// place.  It's named after the directory's device and inode, and only
+// used if the directory's timestamps and the options that change what a
+// listing holds still match.
+typedef struct disk_cache_header {
+    char     magic[8];
+    uint64_t dev;
+    uint64_t ino;
+    int64_t  mtime_sec;
+    int64_t  mtime_nsec;
+    int64_t  ctime_sec;
+    int64_t  ctime_nsec;
+    uint32_t options;     // See disk_cache_options.
+    char     collate[64]; // LC_COLLATE the names were sorted under.
+    // Everything above says whether the file can be used.
+    uint64_t used; // Bytes of arena after the header.
+    uint32_t names;
+    uint32_t widths;
+    uint32_t kinds;
+    uint32_t cells;
+    int32_t  count;
+    int32_t  widest;
+    int32_t  total_length;
+    int32_t  sampled;
+    int32_t  refined;
+} disk_cache_header;
+
+// The options a listing depends on: which names are kept, how wide they
+// print and whether any need a stat.
+static uint32_t disk_cache_options() {
+    return cfg_show_dotfiles | cfg_print_hex << 1 | (cfg_color || cfg_indicate) << 2;
+}
+
+// Fill in the part of a header that says what it's a listing of.
+// Returns false if the locale's name doesn't fit.
+static bool disk_cache_identify(disk_cache_header * h, const struct stat * st) {
+    const char * collate = setlocale(LC_COLLATE, NULL);
+
+    memset(h, 0, sizeof(*h));
+    if (collate == NULL || strlen(collate) >= sizeof(h->collate)) return false;
+
+    memcpy(h->magic, DISK_CACHE_MAGIC, sizeof(h->magic));
+    strcpy(h->collate, collate);
+    h->dev        = st->st_dev;
+    h->ino        = st->st_ino;
+    h->mtime_sec  = st->st_mtim.tv_sec;
+    h->mtime_nsec = st->st_mtim.tv_nsec;
+    h->ctime_sec  = st->st_ctim.tv_sec;
+    h->ctime_nsec = st->st_ctim.tv_nsec;
+    h->options    = disk_cache_options();
+    return true;
+}
+
+// The cache file for the directory st describes, in $XDG_CACHE_HOME/peek,
+// or NULL if there's nowhere to put it.  With create, the directory it
+// goes in is made if needed.
+static char * disk_cache_path(const struct stat * st, bool create) {
+    static char path[PATH_MAX];
+    // Leaves room for the name and the suffix of a temporary copy.
+    int         len = cache_dir(path, sizeof(path), create);
+
+    if (len < 0) return NULL;
+    sprintf(path + len, "/%llx-%llx", (unsigned long long)st->st_dev, (unsigned long long)st->st_ino);
+    return path;
+}
+
+// Whether the arena of a mapped cache file holds what its header says,
+// so nothing in it is reached outside the mapping.  Every name has to end
+// before the arena does, which it does if it starts before the last NUL.
+static bool disk_cache_check(const disk_cache_header * h, const char * mem) {
+    const uint32_t *      names = (const uint32_t *)(mem + h->names);
+    const unsigned char * kinds = (const unsigned char *)mem + h->kinds;
+    uint64_t              end   = h->used; // Just past the last NUL.
+
+    if (h->names % _Alignof(uint32_t) || h->widths % _Alignof(uint16_t) || h->cells % _Alignof(termpos)
+        || h->widest < 0 || h->total_length < 0 || h->refined < 0 || h->refined > h->count) {
+        return false;
+    }
+    while (end > 0 && mem[end - 1] != 0) --end;
+
+    for (int i = 0; i < h->count; ++i) {
+        // The type byte comes first.
+        if (names[i] < 1 || names[i] >= end) return false;
+        if ((kinds[i] & KIND_MASK) > KIND_EXEC || (kinds[i] & ~(KIND_MASK | KIND_TYPED | KIND_MEASURED))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Map the saved listing of the directory st describes, if it's still good.
+// One that doesn't hold together is removed, and the directory is scanned.
+static listing * disk_cache_load(const struct stat * st) {
+    disk_cache_header h;
+    disk_cache_header want;
+    struct stat       file;
+    listing *         l;
+    char *            map;
+    char *            path;
+    int               fd;
+
+    if (!cfg_disk_cache || cfg_oneshot || !disk_cache_identify(&want, st)) return NULL;
+    if ((path = disk_cache_path(st, false)) == NULL || (fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) return NULL;
+
+    if (fstat(fd, &file) < 0 || pread(fd, &h, sizeof(h), 0) != sizeof(h)
+        || memcmp(&h, &want, offsetof(disk_cache_header, used)) != 0) {
+        close(fd);
+        return NULL;
+    }
+    if ((uint64_t)file.st_size != DISK_CACHE_HEADER_SIZE + h.used || h.used > ARENA_MAX_SIZE || h.count < 0
+        || h.names + sizeof(uint32_t) * h.count > h.used || h.widths + sizeof(uint16_t) * h.count > h.used
+        || h.kinds + (uint64_t)h.count > h.used || h.cells + sizeof(termpos) * h.count > h.used) {
+        close(fd);
+        unlink(path);
+        return NULL;
+    }
+
+    // Private, so it can be changed in memory like any other listing.
+    map = mmap(NULL, file.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    if (!disk_cache_check(&h, map + DISK_CACHE_HEADER_SIZE)) {
+        munmap(map, file.st_size);
+        unlink(path);
+        return NULL;
+    }
+
+    if ((l = calloc(1, sizeof(*l))) == NULL) exit(1);
+    l->map          = map;
+    l->map_size     = file.st_size;
+    l->mem          = map + DISK_CACHE_HEADER_SIZE;
+    l->size         = h.used;
+    l->used         = h.used;
+    l->names        = h.names;
+    l->widths       = h.widths;
+    l->kinds        = h.kinds;
+    l->cells        = h.cells;
+    l->count        = h.count;
+    l->capacity     = h.count;
+    l->widest       = h.widest;
+    l->total_length = h.total_length;
+    l->sampled      = h.sampled;
+    l->refined      = h.refined;
+    listing_stamp(l, st);
+#if DEBUG
+    ++stats.disk_hits;
+#endif
+    return l;
+}
+
+static bool write_all(int fd, const void * buf, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, buf, size);
+
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        buf   = (const char *)buf + n;
+        size -= n;
+    }
+    return true;
+}
+
+// Keep a listing on disk for the next run, unless it's small, might be
+// out of date already or is saved as it is.  It's written to a temporary
+// file and renamed over the old one, so no run reads half of one.
+static void disk_cache_save(const listing * l) {
+    static char       page[DISK_CACHE_HEADER_SIZE];
+    char              tmp[PATH_MAX];
+    disk_cache_header h;
+    disk_cache_header old;
+    struct stat       st = { 0 };
+    char *            path;
+    bool              ok;
+    int               len;
+    int               fd;
+
+    if (!cfg_disk_cache || cfg_oneshot || l == NULL || l->partial || !l->cacheable
+        || l->spill || l->count < DISK_CACHE_MIN) {
+        return;
+    }
+
+    st.st_dev  = l->dev;
+    st.st_ino  = l->ino;
+    st.st_mtim = l->mtime;
+    st.st_ctim = l->ctime;
+    if (!disk_cache_identify(&h, &st) || (path = disk_cache_path(&st, true)) == NULL) return;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0) {
+        bool same = pread(fd, &old, sizeof(old), 0) == sizeof(old)
+            && memcmp(&old, &h, offsetof(disk_cache_header, used)) == 0;
+
+        close(fd);
+        if (same) return;
+    }
+
+    h.used         = l->used;
+    h.names        = l->names;
+    h.widths       = l->widths;
+    h.kinds        = l->kinds;
+    h.cells        = l->cells;
+    h.count        = l->count;
+    h.widest       = l->widest;
+    h.total_length = l->total_length;
+    h.sampled      = l->sampled;
+    h.refined      = l->refined;
+    memcpy(page, &h, sizeof(h));
+
+    // A cut short name would be some other file, so don't write one.
+    len = snprintf(tmp, sizeof(tmp), "%s.%d", path, (int)getpid());
+    if (len < 0 || (size_t)len >= sizeof(tmp)) return;
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) < 0) return;
+    ok = write_all(fd, page, sizeof(page)) && write_all(fd, l->mem, l->used);
+    if (close(fd) < 0) ok = false;
+
+    if (!ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return;
+    }
+#if DEBUG
+    ++stats.disk_saves;
+#endif
+}
+
+// The selection the prefetch timer is waiting on.  Only the UI thread touches this.
+static struct {
+    bool            armed;
+    struct timespec since;      // When the selection came to rest.
+    int             selected;   // SELECTED_NOT after the listing changes.
+    unsigned        parent_for; // The scan_generation the parent was last prefetched for.
+} prefetch = { false, { 0, 0 }, SELECTED_NOT, 0 };
+
+// The columns entries are laid out in, like ls: row by row in as many
+// columns as fit the terminal, each as wide as the widest entry in it.
+// There are max_column of them.  See layout_columns.
+static struct {
+    int * widths;                   // Of each column, indicator included but not the delimiter.
+    int * starts;                   // The terminal column each starts at.
+    int * tally;                    // Entries of each length.  See columns_longest.
+    int   size;                     // Room in the arrays.
+    int   widest;                   // The widest of them.
+    int   term;                     // The terminal width they were fit to.
+    bool  stale;                    // The entries on display changed length since.
+    int   longest[COLUMN_LONGEST];  // Indices of the longest entries, in order.
+} columns;
+
+// Entries as last drawn into the grid, so drawing one again is a copy of
+// its cells rather than working out its name's widths, truncation and
+// escapes again.  Entries are known by their names' offsets, which stay
+// put when changes to the directory move them to other indexes, and are
+// hashed to slots, twice as many as a page holds.  The selection has a
+// slot of its own, since it's drawn highlighted.
+static struct {
+    cell *          cells;  // width cells to a slot, the selection's last.
+    uint32_t *      names;  // The name offset of the entry in each slot, or 0.
+    unsigned char * kinds;  // The kind it was drawn as.  Kinds can be found out late.
+    int *           widths; // The cells it took, since columns differ.
+    int             slots;  // Not counting the selection's.
+    int             width;  // The most cells a slot holds.
+} entry_cache;
+
+// Empty the cache, for a listing whose offsets mean other names.
+static void entry_cache_clear() {
+    if (entry_cache.names) memset(entry_cache.names, 0, sizeof(uint32_t) * (entry_cache.slots + 1));
+}
+
+// Make room for a page of count entries of up to width cells.
+// Growing empties it.
+static void entry_cache_fit(int count, int width) {
+    count *= 2;
+    if (count <= entry_cache.slots && width <= entry_cache.width) return;
+    if (count < entry_cache.slots) count = entry_cache.slots;
+    if (width < entry_cache.width) width = entry_cache.width;
+
+    entry_cache.cells  = realloc(entry_cache.cells, sizeof(cell) * (count + 1) * width);
+    entry_cache.names  = realloc(entry_cache.names, sizeof(uint32_t) * (count + 1));
+    entry_cache.kinds  = realloc(entry_cache.kinds, count + 1);
+    entry_cache.widths = realloc(entry_cache.widths, sizeof(int) * (count + 1));
+    if (!entry_cache.cells || !entry_cache.names || !entry_cache.kinds || !entry_cache.widths) exit(1);
+
+    entry_cache.slots = count;
+    entry_cache.width = width;
+    entry_cache_clear();
+}
+
+// Point the entry arrays at those of the listing on display,
+// wherever its arena is now.
+static void locate_entries() {
+    bool any = shown && shown->count > 0;
+
+    entry_names = any ? listing_names(shown) : NULL;
+    entry_kinds = any ? listing_kinds(shown) : NULL;
+    entry_cells = any ? listing_cells(shown) : NULL;
+    entry_base  = any ? shown->base : 0;
+    entry_count = shown ? shown->count : 0;
+}
+
+// Make l the listing on display.  The old one goes to the cache.
+static void show_listing(listing * l) {
+    cache_put(shown);
+    shown = l;
+    prefetch.selected = SELECTED_NOT;
+
+    locate_entries();
+    entry_cache_clear();
+    columns.stale = true;
+    total_length  = l ? l->total_length : 0;
+    formatted     = 1;
+
+    if (entry_count <= 0) selected_name[0] = 0;
+
+    // The next refresh needs to know that the data on screen is no longer valid.
+    display_is_dirty = true;
+}
+
+// Start scanning current_fd in the background, cancelling any scan in progress.
+static void request_scan() {
+    scan_job job = scan_job_new(".");
+
+    job.epoch      = &scan_generation;
+    job.generation = atomic_fetch_add(&scan_generation, 1) + 1;
+    // A listing that's already up can stay until the new one is done.
+    job.preview    = shown == NULL && !cfg_oneshot && isatty(STDOUT_FILENO);
+    job.prefetch   = false;
+
+    // This scan gets the scanner to itself.
+    atomic_fetch_add(&prefetch_generation, 1);
+
+    pthread_mutex_lock(&scanner.lock);
+
+    scanner_start();
+
+    if (scanner.has_next) scan_job_release(&scanner.next);
+    scanner.next     = job;
+    scanner.has_next = true;
+    pthread_cond_signal(&scanner.wake);
+
+    pthread_mutex_unlock(&scanner.lock);
+
+    scan_pending = true;
+}
+
+// Show the newest listing from the scanner thread, if there is one.
+// Returns true if there was something new to show.
+static bool take_scan_result() {
+    char      drain[64];
+    listing * l;
+
+    while (read(scan_wake[0], drain, sizeof(drain)) > 0);
+
+    take_prefetch_results();
+
+    if ((l = atomic_exchange(&scan_result, NULL)) == NULL) return false;
+
+    if (l->generation != atomic_load(&scan_generation)) {
+        // Superseded by a newer scan.
+        listing_free(l);
+        return false;
+    }
+
+    if (!l->partial) scan_pending = false;
+    show_listing(l);
+    return true;
+}
+
+// Wait up to timeout milliseconds (forever if negative) for the pending scan,
+// returning early once it has sent something to show.
+static void await_scan(int timeout) {
+    struct pollfd fd = { scan_wake[0], POLLIN, 0 };
+
+    while (scan_pending && poll(&fd, 1, timeout) > 0) {
+        if (take_scan_result()) return;
+    }
+}
+
+// The length of the entry at index in a column no wider than most.
+static inline int column_length(const uint16_t * lengths, const unsigned char * kinds, int index, int most) {
+    int length = lengths[index] + (kind_indicator(kinds[index]) ? 1 : 0);
+
+    if (length > most) length = most;
+    if (length < 1)    length = 1;
+    return length;
+}
+
+// Find up to COLUMN_LONGEST of the longest entries, for columns_try to fit
+// first, and return how many there are in columns.longest.  Lengths are
+// tallied to find the shortest of them, then the entries are gathered in
+// order, as they'd go in columns.
+static int columns_longest(int most) {
+    const uint16_t *      lengths = listing_widths(shown);
+    const unsigned char * kinds   = listing_kinds(shown);
+    int *                 tally   = columns.tally;
+    int                   least   = most;
+    int                   found   = 0;
+
+    memset(tally, 0, sizeof(*tally) * (most + 1));
+    for (int i = 0; i < entry_count; ++i) ++tally[column_length(lengths, kinds, i, most)];
+    for (int sum = tally[most]; least > 1 && (sum == 0 || sum + tally[least - 1] <= COLUMN_LONGEST);) {
+        sum += tally[--least];
+    }
+    for (int i = 0; i < entry_count && found < COLUMN_LONGEST; ++i) {
+        if (column_length(lengths, kinds, i, most) >= least) columns.longest[found++] = i;
+    }
+    return found;
+}
+
+// Whether entries fit the line in count columns, each no wider than most.
+// If so, widths has what each column needs.  The first picked of
+// columns.longest are fit first, as the longest usually decide it, and the
+// entries gone over are added to seen.  The last column's delimiter isn't
+// printed, and as with ls, the terminal's last column is left empty.
+static bool columns_try(int count, int most, int * widths, int picked, long * seen) {
+    const uint16_t *      lengths = listing_widths(shown);
+    const unsigned char * kinds   = listing_kinds(shown);
+    int                   line    = count * ENTRY_DELIM_LEN;
+    int                   limit   = termsize.ws_col + ENTRY_DELIM_LEN;
+
+    memset(widths, 0, sizeof(*widths) * count);
+    // Widths are only ever wider, so a line too long stays too long, and
+    // fitting any of the entries first doesn't change what all of them need.
+    for (int k = 0; k < picked; ++k) {
+        int i      = columns.longest[k];
+        int j      = i % count;
+        int length = column_length(lengths, kinds, i, most);
+
+        if (length > widths[j]) {
+            line += length - widths[j];
+            if (line >= limit) {
+                *seen += k + 1;
+                return false;
+            }
+            widths[j] = length;
+        }
+    }
+    for (int i = 0, j = 0; i < entry_count; ++i) {
+        int length = column_length(lengths, kinds, i, most);
+
+        if (length > widths[j]) {
+            line += length - widths[j];
+            if (line >= limit) {
+                *seen += picked + i + 1;
+                return false;
+            }
+            widths[j] = length;
+        }
+        if (++j == count) j = 0;
+    }
+
+    *seen += picked + entry_count;
+    return true;
+}
+
+// Work out the columns for the listing on display, if its entries or the
+// terminal's width changed since.  As with ls, the most columns that fit
+// are kept, out of as many as the shortest and longest entries allow,
+// which is at most a third of the terminal's width.  Counts are tried one
+// at a time from the most down, since those that don't fit are usually
+// too wide within the first few rows.  One that only gets too wide near
+// the end costs a pass over the entries, though, so once the tries have
+// gone over as many entries as there are, the longest entries are found
+// and each count left is fit to those first, which rules out most of the
+// rest for a step apiece.  Entries that are too wide together without any
+// being among the longest still cost a pass for each count, as they do
+// for ls.  bench/layout.c times both.  Layouts from a sample or a window
+// don't have every entry's length, so theirs are as wide as the widest.
+// Entries wider than the terminal are cut to one column that fits.
+// Returns true if the columns changed.
+static bool layout_columns() {
+    int   most   = termsize.ws_col > 2 ? termsize.ws_col - 1 : 1;
+    int   count  = 1;
+    int   old    = max_column;
+    int   widest = 0;
+    long  seen   = 0;
+    int   picked = 0;
+    bool  changed;
+    int * widths;
+
+    if (!columns.stale && columns.term == termsize.ws_col && max_column > 0) return false;
+
+#if DEBUG
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    ++stats.column_layouts;
+#endif
+
+    // No column is narrower than one, so there are never more than that.
+    if (termsize.ws_col + 1 > columns.size) {
+        columns.size   = termsize.ws_col + 1;
+        columns.widths = realloc(columns.widths, sizeof(int) * columns.size * 2);
+        columns.starts = realloc(columns.starts, sizeof(int) * columns.size);
+        columns.tally  = realloc(columns.tally, sizeof(int) * (columns.size + 1));
+        if (!columns.widths || !columns.starts || !columns.tally) exit(1);
+    }
+    // The second half holds the widths being tried.
+    widths = columns.widths + columns.size;
+
+    if (entry_count <= 0) {
+        widths[0] = most;
+    } else if (shown->sampled || shown->spill) {
+        widths[0] = shown->widest < most ? shown->widest : most;
+        if (widths[0] < 1) widths[0] = 1;
+        count     = (termsize.ws_col + ENTRY_DELIM_LEN - 1) / (widths[0] + ENTRY_DELIM_LEN);
+        if (count > entry_count) count = entry_count;
+        if (count < 1)           count = 1;
+        for (int j = 1; j < count; ++j) widths[j] = widths[0];
+    } else {
+        const uint16_t *      lengths  = listing_widths(shown);
+        const unsigned char * kinds    = listing_kinds(shown);
+        int                   shortest = most;
+        int                   longest  = 0;
+
+        for (int i = 0; i < entry_count; ++i) {
+            int length = lengths[i] + (kind_indicator(kinds[i]) ? 1 : 0);
+
+            if (length > longest)  longest  = length;
+            if (length < shortest) shortest = length;
+        }
+        if (longest > most) longest = most;
+        if (shortest < 1)   shortest = 1;
+
+        // One column is the longest entry's and the rest at least the shortest's.
+        count = (termsize.ws_col - 1 - longest) / (shortest + ENTRY_DELIM_LEN) + 1;
+        if (count > entry_count) count = entry_count;
+        for (; count > 1 && !columns_try(count, most, widths, picked, &seen); --count) {
+            if (picked == 0 && seen >= entry_count) picked = columns_longest(most);
+        }
+        if (count <= 1) {
+            count     = 1;
+            widths[0] = longest;
+        }
+    }
+
+    changed = count != old || memcmp(widths, columns.widths, sizeof(int) * count) != 0;
+    memcpy(columns.widths, widths, sizeof(int) * count);
+    for (int j = 0, start = 1; j < count; start += widths[j++] + ENTRY_DELIM_LEN) {
+        columns.starts[j] = start;
+        if (widths[j] > widest) widest = widths[j];
+    }
+
+    max_column     = count;
+    columns.widest = widest;
+    columns.term   = termsize.ws_col;
+    columns.stale  = false;
+
+#if DEBUG
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    stats.column_entries += seen > 0 ? entry_count : 0;
+    stats.column_steps   += seen;
+    stats.column_seconds += (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+#endif
+    return changed;
+}
+
+// Width of the column the entry at index is laid out in.
+static int entry_column(int index) {
+    return columns.widths[(index - i_offset) % max_column];
+}
+
+// Cells the entry at index is drawn in: its column's, and the delimiter
+// after it unless it's in the last column.
+static int entry_span(int index) {
+    int column = (index - i_offset) % max_column;
 
-static void restore_tcattr() {
-    printf(ANSI_SHOW_CURSOR);
-    fflush(stdout);
-    tcsetattr(STDIN_FILENO, TCSANOW, &tcattr_old);
+    return columns.widths[column] + (column < max_column - 1 ? ENTRY_DELIM_LEN : 0);
 }
 
-static void restore_tcattr_and_clean() {
-    if (cfg_oneshot) {
-        // The cursor is never moved in oneshot mode,
-        // so just print a newline to finish output.
-        putchar('\n');
-    } else {
-        if (cfg_clear_trace) {
-            // Clear everything beyond the cursor.
-            printf("\e[0J\e[2K");
-        } else {
-            // Move down a line for every line printed.
-            for (int l = 0; l <= newline_count; ++l) putchar('\n');
+// Make sure the entries from through to on display are colored right.
+// For a windowed listing, the window is moved to them first if need be.
+// A page never holds more than a window, so at most that many are done.
+static void type_shown(int from, int to) {
+    int grown;
+
+    if (entry_count <= 0) return;
+    if (to > SELECTED_MAX) to = SELECTED_MAX;
+
+    if (shown->spill) {
+        if (to >= from + WINDOW_SIZE) to = from + WINDOW_SIZE - 1;
+        if (from < shown->base || to >= shown->base + shown->resident) {
+            window_load(shown, from, to);
+            locate_entries();
+            entry_cache_clear();
         }
+        // Stats done before the window last moved come back undone, so
+        // what they add to the total length isn't kept.  Nothing that big
+        // fits on one line anyway.
+        type_range(shown, current_fd, from - entry_base, to - entry_base);
+        return;
     }
 
-    restore_tcattr();
+    grown = type_range(shown, current_fd, from, to);
+    shown->total_length += grown;
+    total_length        += grown;
+    // Executables are a column longer with -F, which can widen theirs.
+    if (grown != 0) columns.stale = true;
 }
 
-// Create raw terminal mode to stop stdin buffer from breaking key press detection.
-// http://pubs.opengroup.org/onlinepubs/000095399/basedefs/termios.h.html#tag_13_74_03_06
-static void replace_tcattr() {
-    static bool first_time = true;
+// Whether a display of count entries shows them a page at a time.
+static bool layout_paged(int count) {
+    return !cfg_oneshot && formatted && (count / max_column > termsize.ws_row);
+}
 
-    if (first_time) {
-        atexit(restore_tcattr_and_clean); // Restore old mode when we're done.
+// Rows of entries on screen for a display of count entries,
+// as laid out by the last renew_display.
+static int layout_rows(int count) {
+    int last = count - 1;
 
-        tcgetattr(STDIN_FILENO, &tcattr_old);
-        memcpy(&tcattr_raw, &tcattr_old, sizeof(struct termios));
-        tcattr_raw.c_cc[VMIN]  = 1;
-        tcattr_raw.c_cc[VTIME] = 0;
-        tcattr_raw.c_lflag &= ~(ECHO | ICANON);
+    if (layout_paged(count) && last > i_limit) last = i_limit;
+    return (last - i_offset) / max_column + 1;
+}
 
-        first_time = false;
-    }
+// Measure another batch of the listing on display if its layout is from a
+// sample.  Once every entry has been, the layout is worked out exactly.
+// Returns true if that changed it.
+static bool layout_refine() {
+    int to;
 
-    tcsetattr(STDIN_FILENO, TCSANOW, &tcattr_raw);
-    printf(ANSI_HIDE_CURSOR);
-}
+    if (shown == NULL || !shown->sampled) return false;
 
-static int display_filter(const struct dirent * ent) {
-    if (ent->d_name[0] == '.') {
-        if (!cfg_show_dotfiles) return 0;
-        else if (ent->d_name[1] == 0) return 0; // Don't show "."
-        else if (ent->d_name[1] == '.' && ent->d_name[2] == 0) return 0; // Don't show ".."
-    }
-    return 1;
+    to = shown->refined + LAYOUT_REFINE_BATCH;
+    if (to > shown->count) to = shown->count;
+    measure_range(shown, shown->refined, to - 1);
+    shown->refined = to;
+    if (to < shown->count) return false;
+
+    shown->sampled = false;
+    listing_layout(shown, 1);
+    total_length  = shown->total_length;
+    columns.stale = true;
+    if (!layout_columns()) return false;
+
+#if DEBUG
+    ++stats.layout_reflows;
+#endif
+    display_is_dirty = true;
+    return true;
 }
 
-static int utf8_char_len(unsigned char c) {
-    if (UTF8_PRINTABLE(c)) {
-        if (UTF8_COUNTABLE(c)) return 1;
-    } else if (cfg_print_hex) {
-        // 3 = \XX
-        if (UTF8_COUNTABLE(c)) return 3;
-    }
-    return 0;
+// The directory on display is watched with inotify, so changes to it show
+// up without a reload.  Names are collected as events come in and applied
+// in batches.  Only the UI thread touches this.
+static struct {
+    int             fd;     // The inotify instance, or -1 if there isn't one.
+    int             wd;     // The watch on current_fd, or -1.
+    char *          names;  // Changed names, back to back.
+    size_t          size;
+    size_t          used;
+    int             count;
+    bool            rescan; // Too much changed to apply piece by piece.
+    struct timespec first;  // When the oldest pending change arrived.
+    struct timespec last;   // When the newest one arrived.
+} watch = { -1, -1 };
+
+static void watch_clear() {
+    watch.used   = 0;
+    watch.count  = 0;
+    watch.rescan = false;
 }
 
-static int utf8_len(unsigned char * str) {
-    int len = 0;
-    for (unsigned char * c = str; *c; ++c) {
-        len += utf8_char_len(*c);
+// Watch the current directory instead of the last one.
+static void watch_dir() {
+#if defined(__linux__)
+    if (cfg_oneshot) return;
+    if (watch.fd < 0 && (watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) return;
+
+    uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | IN_ONLYDIR;
+
+    if (watch.wd >= 0) inotify_rm_watch(watch.fd, watch.wd);
+    // inotify only takes paths.  The one under /proc is short and exact.
+    if ((watch.wd = inotify_add_watch(watch.fd, fd_link(current_fd), mask)) < 0) {
+        watch.wd = inotify_add_watch(watch.fd, dir_path(), mask);
     }
-    return len;
+    watch_clear();
+#endif
 }
 
-// getcwd, but without an existing buffer.
-// The buffer will resize until it can fit
-// the current working directory, even if
-// it is larger than PATH_MAX.
-static char * sturdy_getcwd() {
-    size_t size  = PATH_MAX;
-    char * path  = NULL;
-    char * valid = NULL;
+// Note that name changed.  NULL means too much changed to keep track of.
+static void watch_note(const char * name) {
+    size_t size;
 
-    for (; !valid; size += PATH_MAX) {
-        path  = realloc(path, size);
-        valid = getcwd(path, size);
+    clock_gettime(CLOCK_MONOTONIC, &watch.last);
+    if (watch.count == 0 && !watch.rescan) watch.first = watch.last;
 
-        if (!valid && errno != ERANGE) {
-            return NULL;
-        }
+    if (watch.rescan) return;
+    if (name == NULL || watch.count == WATCH_PENDING_MAX) {
+        watch.rescan = true;
+        return;
     }
 
-    return path;
+    size = strlen(name) + 1;
+    if (watch.used + size > watch.size) {
+        watch.size  = (watch.used + size) * 2;
+        watch.names = realloc(watch.names, watch.size);
+        if (watch.names == NULL) exit(1);
+    }
+    memcpy(watch.names + watch.used, name, size);
+    watch.used += size;
+    ++watch.count;
 }
 
-static bool sturdy_chdir(char * path) {
-    // TODO: If path is longer than PATH_MAX, this will fail.
-    // If it does, break it up until it works.
+// Collect whatever events are waiting.
+static void watch_read() {
+#if defined(__linux__)
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
 
-    return chdir(path) == 0;
-}
+    if (watch.fd < 0) return;
 
-static void get_entry_type(struct dirent * ent, const char ** color, char * indicator) {
-    static const char * colors[] = {
-        0,          // DT_UNKNOWN
-        "\e[33m",   // DT_FIFO
-        "\e[33;1m", // DT_CHR
-        0,
-        "\e[34;1m", // DT_DIR
-        0,
-        "\e[33;1m", // DT_BLK
-        0,
-        0,          // DT_REG
-        0,
-        "\e[36;1m", // DT_LNK
-        0,
-        "\e[35;1m", // DT_SOCK
-    };
-    static const char indicators[] = "\0|\0\0/\0\0\0\0\0@\0=";
+    while ((len = read(watch.fd, buf, sizeof(buf))) > 0) {
+        const struct inotify_event * ev;
 
-    if (ent->d_type > 0 && ent->d_type <= DT_SOCK
-        && (colors[ent->d_type] || indicators[ent->d_type])) {
-        *color     = colors[ent->d_type];
-        *indicator = indicators[ent->d_type];
-    } else {
-        // d_type couldn't tell us anything, so check if executable.
-        if (access(ent->d_name, X_OK) == 0) {
-            *color     = "\e[32;1m";
-            *indicator = '*';
-        } else {
-            *color     = 0;
-            *indicator = 0;
+        for (char * p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *)p;
+#if DEBUG
+            ++stats.watch_events;
+#endif
+            // Events from directories watched before are left behind.
+            if (ev->mask & IN_Q_OVERFLOW) watch_note(NULL);
+            else if (ev->wd == watch.wd && ev->len > 0) watch_note(ev->name);
         }
     }
+#endif
 }
 
-static void run_scan() {
-    int old_entry_count = entry_count;
-    int longest_entry_len = 0;
-    int len = 0;
+// Milliseconds until pending changes should be applied, or -1 if there aren't any.
+static int watch_timeout() {
+    long quiet;
+    long late;
 
-    // The next refresh needs to know that the data on screen is no longer valid.
-    display_is_dirty = true;
+    if (watch.count == 0 && !watch.rescan) return -1;
 
-    entry_count = scandir(current_dir, &posix_entries, display_filter, alphasort);
-    if (entry_count <= 0) {
-        selected_name[0] = 0;
-        return;
+    // A scan on its way gets the changes once it's shown.
+    if (scan_pending) return -1;
+
+    quiet = WATCH_QUIET_MS - ms_since(&watch.last);
+    late  = WATCH_MAX_DELAY_MS - ms_since(&watch.first);
+    if (late < quiet) quiet = late;
+    return quiet > 0 ? quiet : 0;
+}
+
+static int compare_strs(const void * a, const void * b) {
+    return strcmp(*(const char * const *)a, *(const char * const *)b);
+}
+
+// Apply pending changes to the listing on display.
+// Returns true if anything on screen has to change.
+static bool watch_apply() {
+    struct stat   st;
+    bool          stamped;
+    const char ** names;
+    int           count     = 0;
+    int           old_count = entry_count;
+    int           first;
+    int           last;
+    uint32_t      selected_off;
+
+    // Take the timestamps first.  Anything changed after this is either
+    // in the events read next or leaves the timestamps out of date.
+    stamped = fstat(current_fd, &st) == 0;
+    watch_read();
+
+    if (shown && shown->spill) {
+        // A windowed listing is too big to keep up with.  R rescans it.
+        watch_clear();
+        return false;
     }
 
-    if (entry_data == NULL || entry_count > old_entry_count) {
-        entry_data = realloc(entry_data, sizeof(*entry_data) * entry_count);
+    if (watch.rescan || shown == NULL || shown->count <= 0) {
+        // Too much changed, or there's no layout to adjust.
+        watch_clear();
+        request_scan();
+#if DEBUG
+        ++stats.watch_rescans;
+#endif
+        return false;
     }
 
-    avg_columns  = 0;
-    total_length = 0;
-    formatted    = 1;
+    names = malloc(sizeof(*names) * watch.count);
+    if (names == NULL) exit(1);
+
+    // Put the names in order so repeats are next to each other, and drop them.
+    for (char * name = watch.names; count < watch.count; name += strlen(name) + 1) {
+        names[count++] = name;
+    }
+    qsort(names, count, sizeof(*names), compare_strs);
+    count = 0;
+    for (int i = 0; i < watch.count; ++i) {
+        if (count == 0 || strcmp(names[count - 1], names[i]) != 0) names[count++] = names[i];
+    }
 
-    // Calculate average display length and total length of output.
+    selected_off = listing_names(shown)[selected < entry_count ? selected : 0];
+    first        = listing_update(shown, current_fd, names, count, &last);
+    free(names);
+    watch_clear();
 
-    for (int i = 0; i < entry_count; ++i) {
-        entry_data[i].len = utf8_len((unsigned char *)posix_entries[i]->d_name);
-        len = entry_data[i].len;
+    if (stamped) listing_stamp(shown, &st);
+#if DEBUG
+    ++stats.watch_updates;
+    stats.watch_changes += count;
+#endif
 
-        get_entry_type(posix_entries[i], &entry_data[i].color, &entry_data[i].indicator);
-        if (!cfg_color)    entry_data[i].color     = 0;
-        if (!cfg_indicate) entry_data[i].indicator = 0;
+    if (shown->garbage > shown->used / 2 && shown->used > ARENA_MIN_SIZE) {
+        // Mostly garbage by now.  A fresh scan packs it again.
+        request_scan();
+    }
 
-        // Try to prevent abnormally sized entries from skewing average.
-        if (i == 0 || (
-                len < avg_columns / i + MIN_ENTRY_LEN
-                && len >= MIN_ENTRY_LEN)) {
-            avg_columns += len;
-        }
+    if (first < 0) return false;
 
-        if (len > longest_entry_len) longest_entry_len = len;
+    // The arena may have moved.
+    locate_entries();
+    total_length = shown->total_length;
 
-        total_length += len;
-        if (entry_data[i].indicator) ++total_length;
-        total_length += ENTRY_DELIM_LEN;
+    // Stay on the same entry if it's still there.
+    if (entry_count > 0) {
+        int i = listing_find(shown, shown->mem + selected_off);
+        if (i >= 0) selected = i;
     }
+    selected_previously = SELECTED_NOT;
 
-    if (entry_count) avg_columns /= entry_count;
-
-    if (cfg_oneshot) {
-        // Don't shorten names in oneshot mode.
-        avg_columns = longest_entry_len;
-    } else if (avg_columns < MIN_ENTRY_LEN) {
-        // Don't force columns to be bigger than the longest entry.
-        avg_columns = longest_entry_len < MIN_ENTRY_LEN ? longest_entry_len : MIN_ENTRY_LEN;
+    if (redraw_from != SELECTED_NOT) {
+        if (redraw_from < first) first = redraw_from;
+        if (redraw_to > last)    last  = redraw_to;
     }
-}
 
-static void free_posix_entries() {
-    if (posix_entries) {
-        for (int i = 0; i < entry_count; ++i) free(posix_entries[i]);
-        free(posix_entries);
-        posix_entries = NULL;
+    // Entries that changed can need wider columns, or fewer.  Those on
+    // screen are colored first, since that can lengthen them too.
+    type_shown(first > i_offset ? first : i_offset,
+               layout_paged(entry_count) && last > i_limit ? i_limit : last);
+    columns.stale = true;
+
+    // Only redraw the cells that changed, unless the layout did or
+    // so many changed that positioning each one costs more than it saves.
+    if (!display_is_dirty && formatted && entry_count > 0
+        && total_length >= termsize.ws_col
+        && layout_paged(old_count) == layout_paged(entry_count)
+        && layout_rows(old_count) == layout_rows(entry_count)
+        && ((last < i_limit ? last : i_limit) - (first > i_offset ? first : i_offset)) * 2
+            < layout_rows(entry_count) * max_column
+        && !layout_columns()) {
+        if (!layout_paged(entry_count)) i_limit = SELECTED_MAX;
+        entry_lines = (entry_count + max_column - 1) / max_column;
+        redraw_from = first;
+        redraw_to   = last;
+    } else {
         display_is_dirty = true;
     }
+
+    return true;
 }
 
-static void cd(char * to) {
-    if (!sturdy_chdir(to)) {
+// Go to the directory to, relative to the one on display.
+// Directories are held open and named relative to each other,
+// so no path is walked from the root and none is too long.
+// Returns false, with the reason in prompt_buffer, if to couldn't be opened.
+static bool cd(const char * to) {
+    struct stat st;
+    listing *   cached = NULL;
+    listing *   saved  = NULL; // The same, if it came from disk.
+    bool        up     = strcmp(to, "..") == 0;
+    bool        popped = up && dir_depth > 0;
+    int         fd;
+
+    if (popped) {
+        fd = dir_stack[--dir_depth];
+    } else if ((fd = openat(current_fd < 0 ? AT_FDCWD : current_fd, to,
+                            O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
         sprintf(prompt_buffer, "%s", strerror(errno));
-        return;
+        prompt = PROMPT_ERR;
+        return false;
     }
 
-    if (current_dir) free(current_dir);
-
-    if ((current_dir = sturdy_getcwd()) == NULL) {
-        // TODO: This is fatal.  Do something to communicate.
-        exit(1);
+    if (current_fd >= 0) {
+        if (up) {
+            close(current_fd);
+        } else {
+            if (dir_depth == DIR_STACK_MAX) {
+                close(dir_stack[0]);
+                memmove(dir_stack, dir_stack + 1, sizeof(*dir_stack) * --dir_depth);
+            }
+            dir_stack[dir_depth++] = current_fd;
+        }
+    }
+    current_fd = fd;
+
+    // Follow the path along by name where that's exact.
+    // Going up from somewhere not come in through may cross a symlink.
+    if (current_dir && popped) {
+        char * slash = strrchr(current_dir, '/');
+        if (slash == current_dir) slash[1] = 0;
+        else if (slash)           slash[0] = 0;
+    } else if (current_dir && !up && strchr(to, '/') == NULL && strcmp(to, ".") != 0) {
+        size_t len = strlen(current_dir);
+
+        if ((current_dir = realloc(current_dir, len + strlen(to) + 2)) == NULL) exit(1);
+        sprintf(current_dir + len, "%s%s", current_dir[len - 1] == '/' ? "" : "/", to);
+    } else {
+        free(current_dir);
+        current_dir = NULL;
     }
 
-    current_dir_len = strlen(current_dir);
+    watch_dir();
+    disk_cache_save(shown);
+    show_listing(NULL);
+    take_prefetch_results();
+
+    if (fstat(current_fd, &st) == 0 && (cached = cache_take(&st)) == NULL) {
+        saved = cached = disk_cache_load(&st);
+    }
 
-    free_posix_entries();
-    run_scan();
+    if (cached) {
+        // Drop whatever scan is still running for the directory left behind.
+        atomic_fetch_add(&scan_generation, 1);
+        scan_pending = false;
+        show_listing(cached);
+    }
+    // A saved listing may be out of date in ways the directory's timestamps
+    // don't show, like a file made executable, so it's checked by a scan.
+    if (cached == NULL || saved) request_scan();
 
     selected            = SELECTED_MIN;
     selected_previously = SELECTED_NOT;
+
+    // Most scans are quick.  Give them a moment so they go straight to the
+    // screen, and slow ones time to send a preview, rather than drawing a
+    // placeholder first.  Oneshot mode only has the one chance to print.
+    if (!saved) await_scan(cfg_oneshot ? -1 : SCAN_PREVIEW_DELAY_MS * 2);
+    return true;
+}
+
+// Called after every redraw.  If the selection moved, restart the prefetch
+// timer and cancel the prefetch of the directory it was on.
+static void prefetch_arm() {
+    if (selected == prefetch.selected) return;
+
+    atomic_fetch_add(&prefetch_generation, 1);
+    prefetch.selected = selected;
+    prefetch.armed    = true;
+    clock_gettime(CLOCK_MONOTONIC, &prefetch.since);
+}
+
+// Milliseconds until the prefetch timer goes off, or -1 if it isn't set.
+static int prefetch_timeout() {
+    long left;
+
+    if (!prefetch.armed) return -1;
+    left = PREFETCH_DELAY_MS - ms_since(&prefetch.since);
+    return left > 0 ? left : 0;
 }
 
-static int get_stdin_chars_ahead() {
-    int ahead;
-    ioctl(STDIN_FILENO, FIONREAD, &ahead);
-    return ahead;
+// Queue a prefetch of name in the directory on display,
+// unless its listing is on display or cached already.
+static int prefetch_queue(scan_job * jobs, int count, const char * name, atomic_uint * epoch) {
+    struct stat st;
+    scan_job *  job = &jobs[count];
+
+    if (fstatat(current_fd, name, &st, 0) < 0 || !S_ISDIR(st.st_mode)
+        || (st.st_dev == shown->dev && st.st_ino == shown->ino) || cache_find(&st)) {
+        return count;
+    }
+
+    *job            = scan_job_new(name);
+    job->epoch      = epoch;
+    job->generation = atomic_load(epoch);
+    job->preview    = false;
+    job->prefetch   = true;
+    return count + 1;
 }
 
-// NOTE: This will eat everything in stdin.
-static void get_cursor_pos(int * row, int * col) {
-    char c;
+// The selection has come to rest.  Scan the directory under it and the
+// parent directory ahead of time, so going into either is instant.
+static void prefetch_start() {
+    scan_job jobs[PREFETCH_MAX];
+    int      count = 0;
+    unsigned generation = atomic_load(&scan_generation);
+
+    prefetch.armed = false;
 
-    if (row) *row = 0;
-    if (col) *col = 0;
+    // The display's own scan comes first.
+    if (scan_pending || entry_count <= 0) return;
 
-    // Attempt to clear out stdin.
-    // CLEANUP: Is read with a NULL buffer really allowed?
-    read(STDIN_FILENO, NULL, get_stdin_chars_ahead());
+    take_prefetch_results();
 
-    // Request cursor position and scan for the response "\e[%d;%dR".
-    // If we read in something that started out correct and became malformed,
-    // it isn't the cursor position response so start over.
-    printf("\e[6n");
-scan_for_esc:
-    while (getchar() != 0x1B);               // Scan for escape.
-    if (getchar() != '[') goto scan_for_esc; // Scan for [
-    while (1) {                              // Scan for %d;
-        c = getchar();
-        if (c == ';') break;
-        else if (c < '0' || c > '9') goto scan_for_esc;
-        if (row) *row = (*row * 10) + (c - '0');
+    if (selected < entry_count && listing_type(shown, selected - entry_base) == DT_DIR) {
+        count = prefetch_queue(jobs, count, entry_name(selected), &prefetch_generation);
     }
-    while (1) {                              // Scan for %dR
-        c = getchar();
-        if (c == 'R') break;
-        else if (c < '0' || c > '9') goto scan_for_esc;
-        if (col) *col = (*col * 10) + (c - '0');
+    if (prefetch.parent_for != generation) {
+        // The parent stays queued while the selection moves around.
+        prefetch.parent_for = generation;
+        count = prefetch_queue(jobs, count, "..", &scan_generation);
+    }
+    if (count == 0) return;
+
+    pthread_mutex_lock(&scanner.lock);
+
+    scanner_start();
+
+    // Whatever was queued before is cancelled or queued again here.
+    for (int i = 0; i < scanner.prefetch_count; ++i) {
+        if (scanner.prefetch[i].epoch == &scan_generation
+            && scanner.prefetch[i].generation == generation && count < PREFETCH_MAX) {
+            jobs[count++] = scanner.prefetch[i];
+        } else {
+            scan_job_release(&scanner.prefetch[i]);
+        }
+    }
+    memcpy(scanner.prefetch, jobs, count * sizeof(*jobs));
+    scanner.prefetch_count = count;
+    pthread_cond_signal(&scanner.wake);
+
+    pthread_mutex_unlock(&scanner.lock);
+}
+
+// Returned by wait_for_input when the scanner sent something to show.
+#define INPUT_SCAN -2
+// Returned by wait_for_input when changes to the directory were applied.
+#define INPUT_WATCH -3
+// Returned by wait_for_input when the layout was worked out exactly.
+#define INPUT_LAYOUT -4
+
+// Wait for a byte of input, a listing from the scanner thread
+// or changes to the directory on display.
+static int wait_for_input() {
+    struct pollfd fds[3] = {
+        { STDIN_FILENO, POLLIN, 0 },
+        { scan_wake[0], POLLIN, 0 },
+        { watch.fd,     POLLIN, 0 },
+    };
+
+    out_flush();
+
+    while (1) {
+        int timeout = prefetch_timeout();
+        int changes = watch_timeout();
+
+        if (changes >= 0 && (timeout < 0 || changes < timeout)) timeout = changes;
+        // Layouts from a sample are refined whenever there's nothing else to do.
+        if (shown && shown->sampled) timeout = 0;
+
+        if (poll(fds, 3, timeout) < 0) {
+            if (errno == EINTR) continue;
+            return EOF;
+        }
+        if (fds[2].revents) watch_read();
+        if (fds[1].revents && take_scan_result()) return INPUT_SCAN;
+        if (fds[0].revents) return read_byte();
+
+        // Timers are checked even when something else woke us up,
+        // so a steady stream of changes still gets applied.
+        if (watch_timeout() == 0 && watch_apply()) return INPUT_WATCH;
+        if (prefetch_timeout() == 0) prefetch_start();
+        if (layout_refine()) return INPUT_LAYOUT;
     }
 }
 
@@ -477,58 +4879,159 @@ static void validate_selection_index() {
     }
 }
 
-static int write_entry(int index) {
-    struct dirent * d_child           = posix_entries[index];
-    const char *    d_child_color     = entry_data[index].color;
-    char            d_child_indicator = entry_data[index].indicator;
+// Print an entry without the delimiter after it.  Returns the columns used.
+static int write_name(int index) {
+    const char *  d_child_name      = entry_name(index);
+    unsigned char d_child_kind      = entry_kinds[index - entry_base];
+    char          d_child_indicator = kind_indicator(d_child_kind);
 
+    utf8_counts counts = utf8_count(d_child_name);
+    int         column = formatted ? entry_column(index) : 0;
+    int         limit  = d_child_indicator ? column - 1 : column;
+    bool        cut    = formatted && utf8_counts_len(counts) > limit;
     int used_chars = 0;
-    int char_len;
+    int size;
 
     // If enabled, print the corresponding color for the type.
-    if (d_child_color) printf("%s", d_child_color);
-    
-    // Print the name of the entry.
-    for (unsigned char * c = (unsigned char *)d_child->d_name; *c; ++c) {
-        char_len = utf8_char_len(*c);
-        used_chars += char_len;
-        
-        if (formatted) {
-            // Stop early for end of column.
+    if (kind_color(d_child_kind)) pen_attr(pen.attr | ATTR_COLOR | (d_child_kind & ATTR_KIND));
 
-            if (used_chars >= (d_child_indicator ? avg_columns - 1 : avg_columns)) {
-                // Replace last character with truncation indictaor.
-                printf(ANSI_RESET "~");
-                if (char_len == 3) used_chars -= 2;
-                break;
+    if (counts.controls == 0 && !cut) {
+        // Nothing to escape and no need to shorten, so print it whole.
+        pen_text(d_child_name, counts.size);
+        used_chars = counts.columns;
+    } else {
+        // Print the name of the entry a code point at a time.
+        for (const unsigned char * c = (const unsigned char *)d_child_name; *c; c += size) {
+            int width = utf8_width(c, &size);
+
+            // 3 = \XX
+            if (!UTF8_PRINTABLE(*c)) width = cfg_print_hex ? 3 : 0;
+            used_chars += width;
+
+            if (cut) {
+                // Stop early for end of column.
+
+                if (used_chars >= limit) {
+                    // Replace last character with truncation indictaor.
+                    pen_attr(0);
+                    pen_put("~", 1, 1);
+                    used_chars += 1 - width;
+                    break;
+                }
             }
-        }
 
-        // This character is printable if
-        // it is above control characters and not DEL.
-        if (UTF8_PRINTABLE(*c)) {
-            putchar(*c);
-        } else if (cfg_print_hex) {
-            printf("\\%02X", (unsigned char)*c);
+            // This character is printable if
+            // it is above control characters and not DEL.
+            if (UTF8_PRINTABLE(*c)) {
+                pen_put(c, size, width);
+            } else if (cfg_print_hex) {
+                pen_hex(*c);
+            }
         }
     }
 
-    printf(ANSI_RESET);
+    // The indicator and padding aren't highlighted.
+    pen_attr(0);
 
     // If enabled, print the corresponding indicator for the type.
     if (d_child_indicator) {
-        putchar(d_child_indicator);
+        pen_put(&d_child_indicator, 1, 1);
         ++used_chars;
     }
 
-    if (formatted) {
-        for (; used_chars < avg_columns; ++used_chars) putchar(' ');
+    if (formatted && used_chars < column) {
+        pen_spaces(column - used_chars);
+        used_chars = column;
     }
-    used_chars += printf(ENTRY_DELIM);
 
     return used_chars;
 }
 
+// Draw a formatted entry into the grid at the pen, from the cache if it's there.
+static void entry_draw(int index) {
+    int           width = entry_span(index);
+    int           delim = width - entry_column(index);
+    uint32_t      name  = entry_names[index - entry_base];
+    unsigned char kind  = entry_kinds[index - entry_base] & KIND_MASK;
+    int           slot;
+    cell *        cells;
+    cell *        at;
+
+    if (pen.row >= grid.rows || pen.col - 1 + width > grid.cols
+        || entry_cache.slots == 0 || width > entry_cache.width) {
+        // Off the grid, so there's nothing to copy.
+        write_name(index);
+        pen_text(ENTRY_DELIM, delim);
+        return;
+    }
+
+    slot  = pen.attr & ATTR_INVERT ? entry_cache.slots : name * 2654435761u % entry_cache.slots;
+    cells = entry_cache.cells + (size_t)slot * entry_cache.width;
+    at    = grid.want + pen.row * grid.cols + pen.col - 1;
+
+    if (entry_cache.names[slot] == name && entry_cache.kinds[slot] == kind
+        && entry_cache.widths[slot] == width) {
+        memcpy(at, cells, sizeof(cell) * width);
+        grid_reach(pen.row);
+        pen.col += width;
+        pen_attr(0);
+#if DEBUG
+        ++stats.entry_cache_hits;
+#endif
+        return;
+    }
+
+    write_name(index);
+    pen_text(ENTRY_DELIM, delim);
+    memcpy(cells, at, sizeof(cell) * width);
+    entry_cache.names[slot]  = name;
+    entry_cache.kinds[slot]  = kind;
+    entry_cache.widths[slot] = width;
+#if DEBUG
+    ++stats.entry_cache_misses;
+#endif
+}
+
+static int write_entry(int index) {
+    int delim = formatted ? entry_span(index) - entry_column(index) : ENTRY_DELIM_LEN;
+    int used;
+
+    if (pen.grid && formatted) {
+        entry_draw(index);
+        return entry_span(index);
+    }
+
+    used = write_name(index);
+    pen_text(ENTRY_DELIM, delim);
+    return used + delim;
+}
+
+// Redraw entries from through to in place, blanking cells past the last one.
+static void redraw_entries(int from, int to) {
+    if (from < i_offset) from = i_offset;
+    if (layout_paged(entry_count) && to > i_limit) to = i_limit;
+
+    type_shown(from, to);
+
+    for (int i = from; i <= to; ++i) {
+        int row = (i - i_offset) / max_column + entry_row_offset;
+        int col = columns.starts[(i - i_offset) % max_column];
+
+        pen_move(row + pos_status_bar.row, col);
+        pen_attr(0);
+
+        if (i >= entry_count) {
+            pen_spaces(entry_span(i));
+            continue;
+        }
+
+        entry_cells[i - entry_base].row = row;
+        entry_cells[i - entry_base].col = col;
+        if (i == selected) pen_attr(ATTR_INVERT);
+        write_entry(i);
+    }
+}
+
 static void renew_display() {
     // If formatting, this will be the next format column to use.
     // If not, this will be the amount of characters printed so far.
@@ -537,66 +5040,99 @@ static void renew_display() {
 
     newline_count = 0;
 
-    if (posix_entries == NULL) run_scan();
-
-    // Return to start of last display and erase previous.
-    // 0J erases below cursor, 2K erases to the right.
+    // The display is drawn from nothing, from the top of the last one.
+    // Oneshot output erases whatever is below the cursor first.
 
-    printf("\e[0J\e[2K");
+    if (pen.grid)   grid_clear();
+    else if (!piped) out_str("\r\e[0J\e[2K");
+    pen_move(0, 1);
 
     // If enabled, print current directory name.
 
     if (!cfg_oneshot) {
-        printf(ANSI_INVERT ANSI_BOLD "%s", current_dir);
-        if (current_dir[0] != 0 && current_dir[1] != 0) putchar('/');
+        const char * path = dir_path();
+
+        pen_attr(ATTR_INVERT | ATTR_BOLD);
+        pen_str(path);
+        if (path[0] != 0 && path[1] != 0) pen_str("/");
+
+        // The status bar follows the path, on the last line it wraps onto.
+        // Filling the last column leaves it on it.
+        pos_status_bar.row = pen.row;
+        pos_status_bar.col = pen.col > termsize.ws_col ? termsize.ws_col : pen.col;
 
-        get_cursor_pos(&pos_status_bar.row, &pos_status_bar.col);
-        printf(ANSI_RESET "\n");
+        pen_attr(0);
+        pen_newline();
         ++newline_count;
     }
 
 #if DEBUG
-    printf("Dev Build %s %s\n", __DATE__, __TIME__);
-    ++newline_count;
+    if (!piped) {
+        pen_str("Dev Build " __DATE__ " " __TIME__);
+        pen_newline();
+        ++newline_count;
+    }
 #endif
 
     entry_row_offset = newline_count;
 
-    printf(ANSI_RESET);
-
-    if (entry_count < 0) {
+    if (piped) {
+        // Whatever reads it only wants names.  main reports a failed scan.
+    } else if (shown == NULL) {
+        // Nothing has come back from the scan yet.  Say so.
+        pen_str(MSG_SCANNING);
+    } else if (entry_count < 0) {
         // The directory couldn't be opened.  Say so.
-        printf(MSG_CANT_SCAN ANSI_RESET);
+        pen_str(MSG_CANT_SCAN);
     } else if (entry_count == 0) {
         // The directory is empty.  Say so.
-        printf(MSG_EMPTY ANSI_RESET);
+        pen_str(MSG_EMPTY);
     }
 
-    // If we can fit on one line, no need to format.
-    if (total_length < termsize.ws_col) {
-        formatted = 0;
+    // Executables are a column longer with -F, so make sure of them
+    // before deciding whether everything fits on one line.
+    if (total_length < termsize.ws_col) type_shown(SELECTED_MIN, SELECTED_MAX);
+
+    // If we can fit on one line, no need to format.  Entries added
+    // since, or a narrower terminal, can need it again.
+    formatted = !piped && total_length >= termsize.ws_col;
+
+    // Coloring a page can lengthen its entries and widen their columns,
+    // which changes what's on the page, so it's laid out until that stops.
+    // Each time colors more, so it soon does.
+    for (int tries = 0; tries < LAYOUT_TRIES && (tries == 0 || columns.stale); ++tries) {
+        layout_columns();
+
+        // If formatted, make sure we can fit all the rows.
+        if (layout_paged(entry_count)) {
+            // A long path wrapped in a short terminal can leave no room,
+            // but a page always has a row.
+            int rows        = termsize.ws_row - pos_status_bar.row - entry_row_offset;
+            int page_length = (rows > 1 ? rows : 1) * max_column;
+
+            i_offset = selected / page_length * page_length;
+            i_limit  = i_offset + page_length - 1;
+        } else {
+            i_offset = SELECTED_MIN;
+            i_limit  = SELECTED_MAX;
+        }
+
+        type_shown(i_offset, i_limit);
     }
 
-    // Calculate how many columns we have.
-    max_column = avg_columns + ENTRY_DELIM_LEN;
-    if (cfg_indicate) ++max_column;
-    max_column = termsize.ws_col / max_column;
-    
-    // If formatted, make sure we can fit all the rows.
-    if (!cfg_oneshot && formatted && (entry_count / max_column > termsize.ws_row)) {
-        int page_length = (termsize.ws_row - entry_row_offset) * max_column;
-        i_offset = selected / page_length * page_length;
-        i_limit  = i_offset + page_length - 1;
-    } else {
-        i_offset = SELECTED_MIN;
-        i_limit  = SELECTED_MAX;
+    if (pen.grid && formatted) {
+        int count = (i_limit < SELECTED_MAX ? i_limit : SELECTED_MAX) - i_offset + 1;
+        entry_cache_fit(count > 0 ? count : 1, columns.widest + ENTRY_DELIM_LEN);
     }
 
     for (int i = i_offset; i <= i_limit && i < entry_count; ++i) {
+        // Oneshot mode prints a windowed listing a window at a time.
+        if (shown->spill && i == entry_base + shown->resident) type_shown(i, i_limit);
+
         if (formatted) {
             // If this entry would line wrap, print a newline.
             if (++next_column > max_column) {
-                putchar('\n');
+                pen_newline();
                 next_column = 1;
                 ++newline_count;
             }
@@ -605,40 +5141,46 @@ static void renew_display() {
         // If this is the currently selected entry,
         // copy the name into the selected name buffer and highlight it.
         if (!cfg_oneshot && i == selected) {
-            memcpy(selected_name, posix_entries[i]->d_name, sizeof(*selected_name) * SELECTED_MAXLEN);
-            printf(ANSI_INVERT);
+            snprintf(selected_name, SELECTED_MAXLEN, "%s", entry_name(i));
+            pen_attr(ATTR_INVERT);
+        }
+
+        if (piped) {
+            write_name(i);
+            pen_newline();
+            continue;
         }
 
         // Save cursor position for later use.
 
         if (formatted) {
-            entry_data[i].row = (i - i_offset) / max_column + entry_row_offset;
-            entry_data[i].col = (i - i_offset) % max_column * (avg_columns + ENTRY_DELIM_LEN) + 1;
+            entry_cells[i - entry_base].row = (i - i_offset) / max_column + entry_row_offset;
+            entry_cells[i - entry_base].col = columns.starts[(i - i_offset) % max_column];
             write_entry(i);
         } else {
-            entry_data[i].row = entry_row_offset;
-            entry_data[i].col = next_column + 1;
+            entry_cells[i - entry_base].row = entry_row_offset;
+            entry_cells[i - entry_base].col = next_column + 1;
             next_column += write_entry(i);
         }
     }
 
-    if (newline_count) {
-        // The terminal may have scrolled and we need to adjust the saved position.
-        // Move cursor up to adjust for possible overflow and save it.
-        int row_after;
-        get_cursor_pos(&row_after, NULL);
-        pos_status_bar.row = row_after - newline_count;
-    }
-
     // Save number of lines taken by entries.  Possibly different from newline_count.
     entry_lines = entry_count / max_column;
     if (entry_count % max_column > 0) entry_lines += 1;
 }
 
 static void refresh_display() {
-    struct winsize new_termsize;
+    struct winsize new_termsize = { 0 };
+#if DEBUG
+    struct timespec draw_start, draw_end;
+    clock_gettime(CLOCK_MONOTONIC, &draw_start);
+#endif
 
-    ioctl(STDOUT_FILENO, TIOCGWINSZ, &new_termsize);
+    // Without a size to go by, lay out for the usual one, as ls does.
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &new_termsize) < 0 || new_termsize.ws_col == 0) {
+        new_termsize.ws_row = 24;
+        new_termsize.ws_col = 80;
+    }
 
     validate_selection_index();
 
@@ -650,52 +5192,203 @@ static void refresh_display() {
         // so we need to completely redraw.
 
         termsize = new_termsize;
+        if (pen.grid) grid_resize(termsize.ws_row, termsize.ws_col);
         renew_display();
         display_is_dirty = false;
     } else {
+        // Redraw entries that changed in place.
+
+        if (redraw_from != SELECTED_NOT) redraw_entries(redraw_from, redraw_to);
+
         // Reflect changes in entry selection.
 
         if (entry_count >= 1) {
-            memcpy(selected_name, posix_entries[selected]->d_name, sizeof(*selected_name) * SELECTED_MAXLEN);
+            snprintf(selected_name, SELECTED_MAXLEN, "%s", entry_name(selected));
 
             if (selected_previously > SELECTED_NOT) {
-                printf("\e[%d;%df" ANSI_RESET,
-                        entry_data[selected_previously].row + pos_status_bar.row,
-                        entry_data[selected_previously].col);
+                pen_move(entry_cells[selected_previously - entry_base].row + pos_status_bar.row,
+                         entry_cells[selected_previously - entry_base].col);
+                pen_attr(0);
                 write_entry(selected_previously);
             }
 
-            printf("\e[%d;%df" ANSI_INVERT,
-                   entry_data[selected].row + pos_status_bar.row,
-                   entry_data[selected].col);
+            pen_move(entry_cells[selected - entry_base].row + pos_status_bar.row,
+                     entry_cells[selected - entry_base].col);
+            pen_attr(ATTR_INVERT);
             write_entry(selected);
         }
     }
 
+    redraw_from = SELECTED_NOT;
+    redraw_to   = SELECTED_NOT;
+
     // Update status bar.
 
     // But not if we're a oneshot.
     if (cfg_oneshot) return;
 
-    printf("\e[%d;%df\e[0K", pos_status_bar.row, pos_status_bar.col);
-    printf(ANSI_BOLD "%s" ANSI_RESET, selected_name);
+    // The status bar is cut off at the edge of the screen.
+    // If it wrapped, it would write over the entries.
+    pen_move(pos_status_bar.row, pos_status_bar.col);
+    pen_clear_line();
+    pen.clip = true;
+    pen_attr(ATTR_BOLD);
+    pen_str(selected_name);
+    pen_attr(0);
+
+    if (shown && shown->partial) {
+        pen_str(shown->sorting ? ENTRY_DELIM "sorting " : ENTRY_DELIM "read ");
+        pen_int(shown->scanned);
+        pen_str(" entries...");
+    }
 
     switch (prompt) {
     case PROMPT_ERR:
-        printf("\e[31m"); // Foreground color red.
+        pen_attr(ATTR_RED);
     case PROMPT_MSG:
-        printf(ENTRY_DELIM "%s" ANSI_RESET, prompt_buffer);
+        pen_str(ENTRY_DELIM);
+        pen_str(prompt_buffer);
+        pen_attr(0);
         prompt = PROMPT_NONE;
         break;
     case PROMPT_FOR:
-        printf(ENTRY_DELIM ":%s", prompt_buffer);
+        pen_str(ENTRY_DELIM ":");
+        pen_str(prompt_buffer);
         break;
     default: break;
     }
 
-    // Return to starting row for next display.
+    pen.clip = false;
+
+    // Print what changed and return to starting row for next display.
+
+    grid_flush();
+
+#if DEBUG
+    clock_gettime(CLOCK_MONOTONIC, &draw_end);
+    stats.draw_seconds += (draw_end.tv_sec - draw_start.tv_sec) + (draw_end.tv_nsec - draw_start.tv_nsec) / 1e9;
+#endif
+}
+
+// Print the entries pushed to l so far and empty it for the next batch.
+// column is where the last line printed ends, or -1 for one per line.
+static void stream_batch(listing * l, int dirfd, uint32_t names_end, int * column) {
+    int count = 0;
+
+    for (uint32_t off = 0; off < names_end; off += strlen(l->mem + off + 1) + 2) ++count;
+    if (count == 0) return;
+
+    l->count = count;
+    l->names = listing_alloc(l, sizeof(uint32_t) * count, _Alignof(uint32_t));
+    listing_alloc_entries(l, count);
+
+    for (uint32_t off = 0, i = 0; off < names_end; ++i) {
+        listing_names(l)[i] = off + 1;
+        measure_entry(l, i, l->mem + off + 1, l->mem[off], 0);
+        off += strlen(l->mem + off + 1) + 2;
+    }
+    type_listing(l, dirfd);
+
+    shown       = l;
+    entry_names = listing_names(l);
+    entry_kinds = listing_kinds(l);
+
+    for (int i = 0; i < count; ++i) {
+        int length = entry_length(l, i);
+
+        if (*column < 0) {
+            write_name(i);
+            out_char('\n');
+            continue;
+        }
+
+        // Wrap before an entry that wouldn't fit, like a one line display would.
+        if (*column > 0 && *column + length > termsize.ws_col) {
+            out_char('\n');
+            *column = 0;
+        }
+        *column += write_entry(i);
+    }
+
+    l->used  = 0;
+    l->count = 0;
+}
+
+// Print the directory at path as it is read, without sorting, in memory
+// bounded by a batch instead of by the directory.  Columns can't be laid
+// out without seeing every entry, so entries are filled onto lines on a
+// terminal, and printed one per line otherwise.
+// Returns false with errno set if the directory couldn't be read.
+static bool stream_directory(const char * path) {
+    listing * l      = listing_new(0);
+    int       column = -1;
+    int       fd;
+
+    if ((fd = openat(AT_FDCWD, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) return false;
+
+    if (isatty(STDOUT_FILENO) && ioctl(STDOUT_FILENO, TIOCGWINSZ, &termsize) == 0) column = 0;
+
+#if defined(__linux__)
+    char * batch = malloc(SCAN_BATCH_SIZE);
+    if (batch == NULL) exit(1);
+
+    while (1) {
+        long nread = syscall(SYS_getdents64, fd, batch, SCAN_BATCH_SIZE);
+#if DEBUG
+        ++stats.scan_syscalls;
+#endif
+        if (nread <= 0) {
+            int error = errno;
+
+            free(batch);
+            close(fd);
+            if (column > 0) out_char('\n');
+            out_flush();
+            errno = error;
+            return nread == 0;
+        }
+
+        for (char * rec = batch, * end = batch + nread; rec < end;) {
+            scan_entry * ent = (scan_entry *)rec;
+
+#if DEBUG
+            ++stats.scan_entries;
+#endif
+            if (display_filter(ent->d_name)) push_entry_name(l, ent->d_name, ent->d_type);
+            rec += ent->d_reclen;
+        }
+
+        stream_batch(l, fd, l->used, &column);
+    }
+#else
+    DIR * dir = fdopendir(fd);
+    struct dirent * dent;
+    int count = 0;
+    int error;
+
+    if (dir == NULL) {
+        close(fd);
+        return false;
+    }
 
-    printf("\e[%d;%df", pos_status_bar.row, 0);
+    // readdir has no batches, so make some.
+    while ((errno = 0, dent = readdir(dir)) != NULL) {
+#if DEBUG
+        ++stats.scan_entries;
+#endif
+        if (display_filter(dent->d_name)) {
+            push_entry_name(l, dent->d_name, dent->d_type);
+            if (++count % TYPE_BATCH == 0) stream_batch(l, fd, l->used, &column);
+        }
+    }
+    error = errno;
+    stream_batch(l, fd, l->used, &column);
+    if (column > 0) out_char('\n');
+    out_flush();
+    closedir(dir);
+    errno = error;
+    return error == 0;
+#endif
 }
 
 // The first string in argv must be exec.
@@ -704,15 +5397,21 @@ static void fork_exec(char * exec, char ** argv) {
     pid_t pid;
 
     // Setup normal terminal environment and clear beyond the cursor.
+    sync_settle();
     restore_tcattr();
-    printf("\e[0J\e[2K");
-    fflush(stdout);
+    out_str("\e[0J\e[2K");
+    out_flush();
+
+    // Whatever the child leaves on the screen is drawn over after.
+    grid.stale = true;
 
     pid = fork();
 
     if (pid > 0) {
         wait(NULL);
     } else if (pid == 0) {
+        // pk itself never changes directory, but its children start in the one on display.
+        if (fchdir(current_fd) < 0) exit(1);
         putenv(EXEC_ENV_NAME "=" EXEC_ENV_VALUE);
         execvp(exec, argv);
         // If we got here, execvp failed.
@@ -806,7 +5505,7 @@ static void handle_user_act(user_action act) {
         cd(selected_name);
         break;
     case USER_ACT_CD_RELOAD:
-        free_posix_entries();
+        request_scan();
         break;
     case USER_ACT_ON_EDIT:
         open_selection(EXEC_NAME_EDITOR);
@@ -827,51 +5526,101 @@ static void handle_user_act(user_action act) {
 int main(int argc, char ** argv) {
     int flag;
     char * start_dir = ".";
+    const char * memory = getenv("PEEK_MEMORY");
 
     setlocale(LC_ALL, "");
 
+#if DEBUG
+    if (getenv("PEEK_STATS")) atexit(print_stats);
+#endif
+
     while ((flag = getopt(argc, argv, SHORT_FLAGS)) != -1) { switch(flag) {
     case 'a': cfg_show_dotfiles = 1; break;
     case 'B': cfg_color         = 0; break;
     case 'c': cfg_clear_trace   = 1; break;
+    case 'C': cfg_disk_cache    = 1; break;
     case 'F': cfg_indicate      = 1; break;
     case 'o': cfg_oneshot       = 1; break;
+    case 'U': cfg_unsorted      = 1; cfg_oneshot = 1; break;
     case 'x': cfg_print_hex     = 1; break;
     case 'h': printf(MSG_HELP, argv[0]); return 0;
     case '?': fprintf(stderr, MSG_INVALID, argv[0], argv[0]); return 1;
     default: abort();
     }}
 
+    if (memory) {
+        char * end;
+        long   mb = strtol(memory, &end, 10);
+
+        // As ls does with a bad COLUMNS, say so and go on without it.
+        if (end == memory || *end != 0 || mb < 1 || mb > MEMORY_BUDGET_MAX_MB) {
+            fprintf(stderr, "%s: ignoring PEEK_MEMORY, which should be 1 to %d MiB\n",
+                    argv[0], MEMORY_BUDGET_MAX_MB);
+        } else {
+            cfg_memory_budget = (size_t)mb << 20;
+        }
+    }
+
     // If there is a remaining argument, it is the directory to start in.
     if (optind < argc) start_dir = argv[optind];
 
-    cd(start_dir);
+    if (cfg_unsorted) {
+        if (stream_directory(start_dir)) return 0;
+        fprintf(stderr, "%s: %s: %s\n", argv[0], start_dir, strerror(errno));
+        return 1;
+    }
 
     // Configure terminal to our needs.
-    replace_tcattr();
+    // This comes first so a slow first scan can draw its progress.
+    // Oneshot output is only printed, so it leaves the terminal as it is.
+    pen.grid = !cfg_oneshot;
+    piped    = cfg_oneshot && !isatty(STDOUT_FILENO);
+    if (!cfg_oneshot) {
+        replace_tcattr();
+        sync_query();
+    }
+
+    if (!cd(start_dir)) {
+        // There's nothing to show without somewhere to start.
+        fprintf(stderr, "%s: %s: %s\n", argv[0], start_dir, prompt_buffer);
+        return 1;
+    }
 
 display_then_wait:
     refresh_display();
 
     if (cfg_oneshot) goto quit;
 
+    prefetch_arm();
+
     // TODO: Most of the letter keybinds should be function keys.
     // Not all keyboards have these letters!
 
 wait_for_user_act:
-    switch (getchar()) {
+    switch (wait_for_input()) {
     default: goto wait_for_user_act;
+    case EOF:
+        goto quit;
+    case INPUT_SCAN:
+        // A scan finished or sent a preview.
+        break;
+    case INPUT_WATCH:
+        // The directory changed.
+        break;
+    case INPUT_LAYOUT:
+        // The columns changed.
+        break;
     case 0x08: // BACKSPACE
     case 0x7F: // DEL
         handle_user_act(USER_ACT_CD_PARENT);
         break;
     case 0x1B: // ESC
         // Eat escape sequence start, then match the code.
-        getchar();
-        switch (getchar()) {
+        read_byte();
+        switch (read_byte()) {
         case '2': // Possible F9-F12.
             // F10 is "^[[21~".
-            if (getchar() == '1' && getchar() == '~') {
+            if (read_byte() == '1' && read_byte() == '~') {
                 goto quit;
             }
             break;
@@ -887,6 +5636,9 @@ wait_for_user_act:
         case 'D': // Left Arrow
             handle_user_act(USER_ACT_MV_LEFT);
             break;
+        case '?': // A reply from the terminal.
+            read_reply();
+            goto wait_for_user_act;
         }
         break;
     case '\n':
@@ -926,5 +5678,16 @@ wait_for_user_act:
     goto display_then_wait;
 
 quit:
+    disk_cache_save(shown);
+    if (cfg_oneshot) {
+        // The cursor is never moved in oneshot mode, so just print a
+        // newline to finish output.  Piped output ends every name with one.
+        if (!piped) out_char('\n');
+        out_flush();
+    }
+    if (piped && entry_count < 0) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], start_dir, MSG_CANT_SCAN);
+        return 1;
+    }
     return 0;
 }
@@ -0,0 +1,137 @@
+// Checks the vector versions of utf8_count against utf8_count_scalar,
+// first on every code point, then on random strings of mostly broken UTF-8.
+// Run with make check.
+
+#define PEEK_TEST 1
+// peek.c is included whole, so its main has to go by another name.
+#define main peek_main
+#include "../peek.c"
+#undef main
+
+#define RANDOM_STRINGS 2000000
+#define RANDOM_MAXLEN  100
+
+typedef utf8_counts (*count_fn)(const unsigned char *);
+
+static count_fn      fns[3];
+static const char *  fn_names[3];
+static int           n_fns;
+static int           failures;
+
+// Blocks are read aligned, so every string is tried at every offset into one.
+static _Alignas(32) unsigned char buf[RANDOM_MAXLEN * 4 + 64];
+
+static uint64_t rng_state = 0x9E3779B97F4A7C15;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state >> 32;
+}
+
+// Encodes c, which may be a surrogate, as UTF-8.  Returns the size.
+static int encode(uint32_t c, unsigned char * out) {
+    if (c < 0x80) {
+        out[0] = c;
+        return 1;
+    }
+    if (c < 0x800) {
+        out[0] = 0xC0 | c >> 6;
+        out[1] = 0x80 | (c & 0x3F);
+        return 2;
+    }
+    if (c < 0x10000) {
+        out[0] = 0xE0 | c >> 12;
+        out[1] = 0x80 | (c >> 6 & 0x3F);
+        out[2] = 0x80 | (c & 0x3F);
+        return 3;
+    }
+    out[0] = 0xF0 | c >> 18;
+    out[1] = 0x80 | (c >> 12 & 0x3F);
+    out[2] = 0x80 | (c >> 6 & 0x3F);
+    out[3] = 0x80 | (c & 0x3F);
+    return 4;
+}
+
+static void check(const unsigned char * str) {
+    utf8_counts expected = utf8_count_scalar(str);
+
+    for (int f = 0; f < n_fns; ++f) {
+        utf8_counts got = fns[f](str);
+
+        if (got.size == expected.size && got.columns == expected.columns
+            && got.controls == expected.controls) continue;
+        if (++failures > 20) continue;
+        fprintf(stderr, "utf8_count_%s: got %d/%d/%d, expected %d/%d/%d for", fn_names[f],
+                got.size, got.columns, got.controls,
+                expected.size, expected.columns, expected.controls);
+        for (const unsigned char * c = str; *c; ++c) fprintf(stderr, " %02X", *c);
+        fprintf(stderr, "\n");
+    }
+}
+
+int main(void) {
+#if HAVE_SSE2
+    fns[n_fns]        = utf8_count_sse2;
+    fn_names[n_fns++] = "sse2";
+    if (__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("popcnt")) {
+        fns[n_fns]        = utf8_count_ssse3;
+        fn_names[n_fns++] = "ssse3";
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        fns[n_fns]        = utf8_count_avx2;
+        fn_names[n_fns++] = "avx2";
+    }
+#endif
+    // The scalar version is the only one.
+    if (n_fns == 0) {
+        printf("utf8_count: nothing to check without SSE2\n");
+        return 0;
+    }
+
+    // Each code point twice, after a run of ASCII that moves it across
+    // block boundaries.
+    for (uint32_t c = 1; c <= 0x10FFFF; ++c) {
+        unsigned char * s = buf + c % 32;
+        int             n = 0;
+
+        for (int i = c % 37; i > 0; --i) s[n++] = 'x';
+        n += encode(c, s + n);
+        n += encode(c, s + n);
+        s[n] = 0;
+        check(s);
+    }
+
+    // Random mixes of ASCII, controls, stray continuation and lead bytes,
+    // and whole code points.
+    for (int i = 0; i < RANDOM_STRINGS; ++i) {
+        unsigned char * s      = buf + rng() % 32;
+        int             length = rng() % RANDOM_MAXLEN;
+        int             n      = 0;
+
+        while (n < length) {
+            uint32_t r = rng();
+
+            switch (r % 6) {
+            case 0: s[n++] = 0x20 + r / 8 % 0x5F; break;
+            case 1: s[n++] = 1 + r / 8 % 0x7F; break;
+            case 2: s[n++] = 0x80 + r / 8 % 0x40; break;
+            case 3: s[n++] = 0xC0 + r / 8 % 0x40; break;
+            case 4: n += encode(1 + r / 8 % 0xFFFF, s + n); break;
+            case 5: n += encode(1 + r / 8 % 0x10FFFF, s + n); break;
+            }
+        }
+        s[n] = 0;
+        check(s);
+    }
+
+    if (failures) {
+        fprintf(stderr, "utf8_count: %d failures\n", failures);
+        return 1;
+    }
+    printf("utf8_count: ok (");
+    for (int f = 0; f < n_fns; ++f) printf("%s%s", f ? ", " : "", fn_names[f]);
+    printf(")\n");
+    return 0;
+}
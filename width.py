@@ -0,0 +1,143 @@
+#!/usr/bin/env python3
+# Generate width.h, the table of how many terminal columns code points take.
+# Run with `make width` after updating Python, whose unicodedata it reads.
+
+import sys
+import unicodedata
+
+BLOCK_BITS = 8
+BLOCK_SIZE = 1 << BLOCK_BITS
+MAX_CODE   = 0x110000
+MIXED      = 0xFF
+
+
+def width(cp):
+    c = chr(cp)
+    category = unicodedata.category(c)
+
+    # Combining marks and format characters don't advance the cursor,
+    # except soft hyphen, which terminals show.
+    if category in ('Mn', 'Me') or (category == 'Cf' and cp != 0xAD):
+        return 0
+    # Hangul medial vowels and final consonants join the syllable before them.
+    if 0x1160 <= cp <= 0x11FF or 0xD7B0 <= cp <= 0xD7FF or cp == 0x200B:
+        return 0
+    # unicodedata calls unassigned code points fullwidth, so they're sorted
+    # out first.  Those in the CJK blocks and planes are wide by default.
+    if category == 'Cn':
+        return 2 if (0x3400 <= cp <= 0x4DBF or 0x4E00 <= cp <= 0x9FFF or 0xF900 <= cp <= 0xFAFF
+                     or 0x20000 <= cp <= 0x2FFFD or 0x30000 <= cp <= 0x3FFFD) else 1
+    if unicodedata.east_asian_width(c) in ('W', 'F'):
+        return 2
+    return 1
+
+
+def lead_width(lead):
+    # The width shared by every code point peek would decode from a sequence
+    # starting with lead, overlong ones included, or MIXED.
+    if lead >= 0xF8:
+        return 1
+    n    = 2 if lead < 0xE0 else 3 if lead < 0xF0 else 4
+    bits = 6 * (n - 1)
+    low  = (lead & (0x7F >> n)) << bits
+    widths = {width(cp) if cp < MAX_CODE else 1 for cp in range(low, low + (1 << bits))}
+    return widths.pop() if len(widths) == 1 else MIXED
+
+
+def main():
+    blocks = []
+    index  = []
+    seen   = {}
+
+    for start in range(0, MAX_CODE, BLOCK_SIZE):
+        packed = bytearray(BLOCK_SIZE // 4)
+        for cp in range(start, start + BLOCK_SIZE):
+            packed[(cp - start) // 4] |= width(cp) << (cp % 4 * 2)
+        packed = bytes(packed)
+        if packed not in seen:
+            seen[packed] = len(blocks)
+            blocks.append(packed)
+        index.append(seen[packed])
+
+    assert len(blocks) <= 256
+
+    out = sys.stdout
+    out.write('// Generated by width.py from Unicode %s.  Do not edit.\n' % unicodedata.unidata_version)
+    out.write('//\n')
+    out.write('// Columns taken by each code point, two bits apiece, in blocks of %d.\n' % BLOCK_SIZE)
+    out.write('// width_index maps the top bits of a code point to its block.\n\n')
+    out.write('#define WIDTH_BLOCK_BITS %d\n' % BLOCK_BITS)
+    out.write('#define WIDTH_MAX_CODE   0x%X\n\n' % MAX_CODE)
+
+    # Lead bytes from 0xC0 up are sorted into classes by two lookups, on
+    # their high and low nibble, ANDed together.  A bit for each row of 16
+    # leads and width other than one, so each row can have its own columns.
+    high = [0] * 16
+    low  = [0] * 16
+    bits = {0: 0, 2: 0, MIXED: 0}
+    bit  = 1
+    for row in range(0xC, 0x10):
+        for w in bits:
+            cols = [col for col in range(16) if lead_width(row << 4 | col) == w]
+            if cols:
+                # peek counts these without checking how long their sequences are.
+                assert w == MIXED or (w == 2 and row == 0xE) or (w == 0 and row < 0xE)
+                assert bit < 0x100
+                high[row] |= bit
+                for col in cols:
+                    low[col] |= bit
+                bits[w] |= bit
+                bit <<= 1
+
+    out.write('// Classes of lead bytes, whose sequences are all the same width or not.\n')
+    out.write('// A lead is in the classes width_lead_high[lead >> 4] & width_lead_low[lead & 15].\n')
+    out.write('#define WIDTH_LEAD_ZERO  0x%02X\n' % bits[0])
+    out.write('#define WIDTH_LEAD_WIDE  0x%02X\n' % bits[2])
+    out.write('#define WIDTH_LEAD_MIXED 0x%02X\n\n' % bits[MIXED])
+    for name, table in (('high', high), ('low', low)):
+        out.write('static const unsigned char width_lead_%s[16] = {\n' % name)
+        out.write('    ' + ' '.join('0x%02X,' % b for b in table) + '\n')
+        out.write('};\n\n')
+
+    # Most CJK and all Hangul syllables are in blocks of 256 code points
+    # below U+10000 that are all wide, whose three byte sequences can be
+    # looked up in a bitmap of 32 bytes.
+    wide = [0] * 32
+    for block in range(256):
+        if all(width(cp) == 2 for cp in range(block << 8, (block + 1) << 8)):
+            wide[block >> 3] |= 1 << (block & 7)
+
+    out.write('// A bit for each block of 256 code points below U+10000 that are all wide.\n')
+    out.write('static const unsigned char width_wide[32] = {\n')
+    for i in range(0, 32, 16):
+        out.write('    ' + ' '.join('0x%02X,' % b for b in wide[i:i + 16]) + '\n')
+    out.write('};\n\n')
+
+    # Most emoji are in U+1F000 to U+1FFFF, in runs of 8 code points that
+    # are all wide, which can be looked up in a bitmap of 64 bytes.
+    emoji = [0] * 64
+    for run in range(512):
+        if all(width(cp) == 2 for cp in range(0x1F000 + run * 8, 0x1F008 + run * 8)):
+            emoji[run >> 3] |= 1 << (run & 7)
+
+    out.write('// A bit for each run of 8 code points from U+1F000 that are all wide.\n')
+    out.write('static const unsigned char width_emoji[64] = {\n')
+    for i in range(0, 64, 16):
+        out.write('    ' + ' '.join('0x%02X,' % b for b in emoji[i:i + 16]) + '\n')
+    out.write('};\n\n')
+
+    out.write('static const unsigned char width_index[%d] = {\n' % len(index))
+    for i in range(0, len(index), 16):
+        out.write('    ' + ' '.join('%3d,' % b for b in index[i:i + 16]) + '\n')
+    out.write('};\n\n')
+
+    out.write('static const unsigned char width_blocks[%d][%d] = {\n' % (len(blocks), BLOCK_SIZE // 4))
+    for block in blocks:
+        out.write('    {\n')
+        for i in range(0, len(block), 16):
+            out.write('        ' + ' '.join('0x%02X,' % b for b in block[i:i + 16]) + '\n')
+        out.write('    },\n')
+    out.write('};\n')
+
+
+main()